@@ -0,0 +1,111 @@
+// measures hashString on the strings the vm hashes: identifiers while compiling and longer strings from copyString
+// build it together with everything in src/ except main.cpp, for example
+//   g++ -std=c++20 -O2 -Iinclude bench/hash.cpp $(ls src/*.cpp | grep -v main.cpp) -o hash_bench
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "object.h"
+#include "vm.h"
+
+using BenchClock = std::chrono::steady_clock;
+
+template <typename F>
+static double nanosecondsPer(size_t operations, F body)
+{
+	const BenchClock::time_point start = BenchClock::now();
+	body();
+	return std::chrono::duration<double, std::nano>(BenchClock::now() - start).count() / static_cast<double>(operations);
+}
+
+static std::vector<std::string> makeStrings(const char* prefix, size_t count, size_t padding)
+{
+	std::vector<std::string> strings;
+	for (size_t i = 0; i < count; i++)
+	{
+		std::string string = prefix + std::to_string(i);
+		string.resize(string.size() + padding, 'x');
+		strings.push_back(std::move(string));
+	}
+	return strings;
+}
+
+static void throughput(const char* name, const std::vector<std::string>& strings, int rounds)
+{
+	uint32_t sum = 0;
+	size_t bytes = 0;
+	for (const std::string& string : strings) bytes += string.size();
+
+	const double ns = nanosecondsPer(rounds * strings.size(), [&]
+	{
+		for (int r = 0; r < rounds; r++) for (const std::string& string : strings) sum += hashString(string.data(), string.size());
+	});
+	const double gbPerSecond = static_cast<double>(bytes) / strings.size() / ns;
+	printf("%-12s %10.1f ns %8.2f GB/s   (%u)\n", name, ns, gbPerSecond, sum);
+}
+
+// copyString hashes, then finds the string already interned
+static void interning(VM& vm, const char* name, const std::vector<std::string>& strings, int rounds)
+{
+	for (const std::string& string : strings) copyString(vm, string.data(), string.size());
+
+	size_t length = 0;
+	const double ns = nanosecondsPer(rounds * strings.size(), [&]
+	{
+		for (int r = 0; r < rounds; r++) for (const std::string& string : strings) length += copyString(vm, string.data(), string.size())->length;
+	});
+	printf("%-12s %10.1f ns   (%zu)\n", name, ns, length);
+}
+
+// a random 32 bit hash gives about n * n / 2^33 equal pairs, the table only uses the low bits
+static void collisions(const char* name, const std::vector<std::string>& strings)
+{
+	std::vector<uint32_t> hashes;
+	for (const std::string& string : strings) hashes.push_back(hashString(string.data(), string.size()));
+
+	std::vector<uint32_t> low(hashes.size());
+	const uint32_t mask = (1u << 20) - 1;
+	std::transform(hashes.begin(), hashes.end(), low.begin(), [mask](uint32_t hash) { return hash & mask; });
+
+	std::sort(hashes.begin(), hashes.end());
+	size_t equal = 0;
+	for (size_t i = 1; i < hashes.size(); i++) equal += hashes[i] == hashes[i - 1];
+
+	// the fullest bucket among 2^20, about 9 for a random hash and a million keys
+	std::vector<uint32_t> buckets(mask + 1);
+	for (const uint32_t hash : low) buckets[hash]++;
+	const uint32_t fullest = *std::max_element(buckets.begin(), buckets.end());
+
+	const double n = static_cast<double>(strings.size());
+	printf("%-12s %8zu equal hashes (%.0f expected), fullest of 2^20 buckets %u\n", name, equal, n * n / 8589934592.0, fullest);
+}
+
+int main()
+{
+	VM vm;
+	initVM(vm);
+	vm.nextGC = SIZE_MAX;
+	vm.nextMinorGC = SIZE_MAX;
+
+	printf("hashString, per string\n");
+	const std::vector<std::string> identifiers = makeStrings("name", 4096, 0);
+	const std::vector<std::string> medium = makeStrings("string", 4096, 40);
+	const std::vector<std::string> text = makeStrings("text", 1024, 1000);
+	throughput("identifiers", identifiers, 2000);
+	throughput("50 bytes", medium, 2000);
+	throughput("1k bytes", text, 200);
+
+	printf("\ncopyString of an interned string, per string\n");
+	interning(vm, "identifiers", identifiers, 500);
+	interning(vm, "1k bytes", text, 50);
+
+	printf("\ncollisions over a million keys\n");
+	collisions("key<n>", makeStrings("key", 1000000, 0));
+	collisions("<n> padded", makeStrings("", 1000000, 24));
+
+	freeVM(vm);
+	return 0;
+}
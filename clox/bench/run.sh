@@ -0,0 +1,14 @@
+#!/bin/sh
+# usage: bench/run.sh clox [clox ...]
+# runs every script in bench/ (or the ones in $SCRIPTS) $RUNS times with each binary and prints the best time,
+# the last line a script prints is the number of seconds it took
+dir=$(dirname "$0")
+runs=${RUNS:-5}
+scripts=${SCRIPTS:-$(cd "$dir" && ls *.lox | sed 's/\.lox$//')}
+
+for script in $scripts; do
+	for clox in "$@"; do
+		best=$(for i in $(seq "$runs"); do "$clox" "$dir/$script.lox" | tail -n 1; done | sort -g | head -n 1)
+		printf "%-12s %-30s %s\n" "$script" "$clox" "$best"
+	done
+done
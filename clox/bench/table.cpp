@@ -0,0 +1,145 @@
+// measures Table the way the vm uses it: global names, the interned strings and the small transition tables of shapes
+// build it together with everything in src/ except main.cpp, for example
+//   g++ -std=c++20 -O2 -Iinclude bench/table.cpp $(ls src/*.cpp | grep -v main.cpp) -o table_bench
+// comment out SWISS_TABLE in common.h to measure the linear probing table instead
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+using BenchClock = std::chrono::steady_clock;
+
+// the keys are interned strings like the vm's own, the gc is held off so they don't have to be rooted
+static std::vector<ObjString*> makeKeys(VM& vm, const char* prefix, size_t count)
+{
+	std::vector<ObjString*> keys;
+	for (size_t i = 0; i < count; i++)
+	{
+		const std::string name = prefix + std::to_string(i);
+		keys.push_back(copyString(vm, name.c_str(), name.size()));
+	}
+	return keys;
+}
+
+// the same order every run, but not the insertion order
+static void shuffle(std::vector<ObjString*>& keys)
+{
+	uint32_t state = 12345;
+	for (size_t i = keys.size() - 1; i > 0; i--)
+	{
+		state = state * 1664525u + 1013904223u;
+		std::swap(keys[i], keys[state % (i + 1)]);
+	}
+}
+
+template <typename F>
+static double nanosecondsPer(size_t operations, F body)
+{
+	const BenchClock::time_point start = BenchClock::now();
+	body();
+	return std::chrono::duration<double, std::nano>(BenchClock::now() - start).count() / static_cast<double>(operations);
+}
+
+// fills a table of at least 64k slots until it reaches the load, then looks keys up the way globals and interning do
+static void largeTable(VM& vm, double load, const std::vector<ObjString*>& keys, const std::vector<ObjString*>& missing)
+{
+	Table table(vm);
+	size_t count = 0;
+	while (table.capacity() < 65536 || count < load * static_cast<double>(table.capacity()))
+	{
+		table.set(keys[count++], NIL_VAL);
+	}
+
+	std::vector<ObjString*> present(keys.begin(), keys.begin() + count);
+	shuffle(present);
+	const int rounds = 20;
+	size_t found = 0;
+	Value value;
+
+	const double get = nanosecondsPer(rounds * count, [&]
+	{
+		for (int r = 0; r < rounds; r++) for (ObjString* key : present) found += table.get(key, &value);
+	});
+	const double hit = nanosecondsPer(rounds * count, [&]
+	{
+		for (int r = 0; r < rounds; r++) for (ObjString* key : present) found += table.findString(key->chars, key->length, key->hash) != nullptr;
+	});
+	const double miss = nanosecondsPer(rounds * count, [&]
+	{
+		for (int r = 0; r < rounds; r++) for (size_t i = 0; i < count; i++)
+		{
+			const ObjString* key = missing[i];
+			found += table.findString(key->chars, key->length, key->hash) != nullptr;
+		}
+	});
+
+	printf("%-8.2f %8zu %8zu %12.1f %12.1f %12.1f   (%zu)\n",
+		static_cast<double>(count) / static_cast<double>(table.capacity()), count, table.capacity(), get, hit, miss, found);
+}
+
+// shapes have a transition per field added after them, so those tables hold a handful of keys
+static void smallTables(VM& vm, size_t fields, const std::vector<ObjString*>& names)
+{
+	const size_t tableCount = 4096;
+	std::vector<std::unique_ptr<Table>> tables;
+	for (size_t i = 0; i < tableCount; i++)
+	{
+		tables.push_back(std::make_unique<Table>(vm));
+		for (size_t j = 0; j < fields; j++) tables.back()->set(names[(i + j) % names.size()], NIL_VAL);
+	}
+
+	const int rounds = 200;
+	size_t found = 0;
+	Value value;
+	const double get = nanosecondsPer(rounds * tableCount * fields, [&]
+	{
+		for (int r = 0; r < rounds; r++) for (size_t i = 0; i < tableCount; i++)
+		{
+			for (size_t j = 0; j < fields; j++) found += tables[i]->get(names[(i + j) % names.size()], &value);
+		}
+	});
+
+	printf("%-8zu %8zu %12.1f   (%zu)\n", fields, tables[0]->capacity(), get, found);
+}
+
+int main()
+{
+	VM vm;
+	initVM(vm);
+	vm.nextGC = SIZE_MAX;
+	vm.nextMinorGC = SIZE_MAX;
+
+#ifdef SWISS_TABLE
+	printf("swiss table\n\n");
+#else
+	printf("linear probing table\n\n");
+#endif
+
+	const std::vector<ObjString*> keys = makeKeys(vm, "name", 120000);
+	const std::vector<ObjString*> missing = makeKeys(vm, "other", 120000);
+
+	printf("globals and interned strings, ns per lookup\n");
+	printf("%-8s %8s %8s %12s %12s %12s\n", "load", "keys", "slots", "get", "find hit", "find miss");
+	for (const double load : { 0.45, 0.55, 0.65, 0.72 })
+	{
+		largeTable(vm, load, keys, missing);
+	}
+
+	printf("\ninstance fields (shape tables), ns per lookup\n");
+	printf("%-8s %8s %12s\n", "keys", "slots", "get");
+	const std::vector<ObjString*> names = makeKeys(vm, "field", 64);
+	for (const size_t fields : { 1, 4, 12 })
+	{
+		smallTables(vm, fields, names);
+	}
+
+	freeVM(vm);
+	return 0;
+}
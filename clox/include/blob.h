@@ -1,5 +1,6 @@
 ﻿#pragma once
 #include <cassert>
+#include <cstdlib>
 
 #include "memory.h"
 
@@ -7,6 +8,7 @@ template <typename T>
 struct Blob
 {
 	Blob() = default;
+	explicit Blob(VM& vm) : m_vm(&vm) {}
 	Blob(const Blob& other) = delete;
 	Blob(Blob&& other);
 	Blob& operator=(const Blob& other) = delete;
@@ -14,6 +16,7 @@ struct Blob
 	virtual ~Blob();
 
 	void write(T entry);
+	void truncate(size_t count);
 
 	// todo: implement negative index support
 	T& operator[](size_t index);
@@ -25,10 +28,12 @@ private:
 	size_t m_count{0};
 	size_t m_capacity{0};
 	T* m_ptr{nullptr}; // nts: better name
+	VM* m_vm{nullptr}; // the vm whose gc the allocation counts towards, scratch blobs don't have one
 };
 
 
 // -----------------------------------------------------------------
+// blobs use the system allocator, a blob that belongs to a vm reports its size to it with countExternal()
 
 template <typename T>
 Blob<T>::Blob(Blob&& other)
@@ -36,7 +41,9 @@ Blob<T>::Blob(Blob&& other)
 	m_count = other.m_count;
 	m_capacity = other.m_capacity;
 	m_ptr = other.m_ptr;
+	m_vm = other.m_vm;
 	other.m_ptr = nullptr;
+	other.m_capacity = 0;
 }
 
 template <typename T>
@@ -45,14 +52,17 @@ Blob<T>& Blob<T>::operator=(Blob&& other)
 	m_count = other.m_count;
 	m_capacity = other.m_capacity;
 	m_ptr = other.m_ptr;
+	m_vm = other.m_vm;
 	other.m_ptr = nullptr;
+	other.m_capacity = 0;
 	return *this;
 }
 
 template <typename T>
 Blob<T>::~Blob()
 {
-	FREE_ARRAY(T, m_ptr, m_capacity);
+	if (m_vm != nullptr) countExternal(*m_vm, sizeof(T) * m_capacity, 0);
+	free(m_ptr);
 }
 
 template <typename T>
@@ -61,12 +71,22 @@ void Blob<T>::write(T entry)
 	if (m_capacity < m_count + 1)
 	{
 		const size_t oldCapacity = m_capacity;
-		m_capacity = GROW_CAPACITY(oldCapacity);
-		m_ptr = GROW_ARRAY(T, m_ptr, oldCapacity, m_capacity);
+		m_capacity = GROW_CAPACITY(m_capacity);
+		m_ptr = static_cast<T*>(realloc(m_ptr, sizeof(T) * m_capacity));
+		if (m_ptr == nullptr) exit(1);
+		if (m_vm != nullptr) countExternal(*m_vm, sizeof(T) * oldCapacity, sizeof(T) * m_capacity);
 	}
 	m_ptr[m_count++] = entry;
 }
 
+// drops entries from the end, keeps the capacity
+template <typename T>
+void Blob<T>::truncate(size_t count)
+{
+	assert(count <= m_count);
+	m_count = count;
+}
+
 template <typename T>
 T& Blob<T>::operator[](size_t index)
 {
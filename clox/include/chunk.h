@@ -15,13 +15,13 @@ enum Op : uint8_t
 	OP_POP,
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
-	OP_GET_GLOBAL,
-	OP_DEFINE_GLOBAL,
-	OP_SET_GLOBAL,
+	OP_GET_GLOBAL,		// operand: 16 bit slot in vm.globalValues
+	OP_DEFINE_GLOBAL,	// operand: 16 bit slot in vm.globalValues
+	OP_SET_GLOBAL,		// operand: 16 bit slot in vm.globalValues
 	OP_GET_UPVALUE,
 	OP_SET_UPVALUE,
-	OP_GET_PROPERTY,
-	OP_SET_PROPERTY,
+	OP_GET_PROPERTY,	// operands: name constant, 16 bit index into Chunk::propertyCaches
+	OP_SET_PROPERTY,	// operands: name constant, 16 bit index into Chunk::propertyCaches
 	OP_EQUAL,
 	OP_GREATER,
 	OP_LESS,
@@ -40,11 +40,123 @@ enum Op : uint8_t
 	OP_CLOSE_UPVALUE,
 	OP_RETURN,
 	OP_CLASS,
+	OP_NOT_EQUAL,
+	OP_GREATER_EQUAL,		// !(a < b), so nan compares like OP_LESS OP_NOT did
+	OP_LESS_EQUAL,			// !(a > b)
+	OP_POP_JUMP_IF_FALSE,	// pops the condition on both paths
+	// superinstructions, also made by the peephole pass
+	OP_ADD_CONSTANT,		// OP_CONSTANT OP_ADD
+	OP_SUBTRACT_CONSTANT,	// OP_CONSTANT OP_SUBTRACT
+	OP_LESS_CONSTANT,		// OP_CONSTANT OP_LESS
+	OP_SET_LOCAL_POP,		// OP_SET_LOCAL OP_POP
+	OP_SET_GLOBAL_POP,		// OP_SET_GLOBAL OP_POP
+	// conditions of if, while and for: pop both operands and jump unless the comparison holds
+	OP_JUMP_UNLESS_EQUAL,
+	OP_JUMP_UNLESS_NOT_EQUAL,
+	OP_JUMP_UNLESS_GREATER,
+	OP_JUMP_UNLESS_LESS,
+	OP_JUMP_UNLESS_GREATER_EQUAL,
+	OP_JUMP_UNLESS_LESS_EQUAL,
+	OP_JUMP_UNLESS_LESS_CONSTANT,	// operands: constant, jump offset
+	// quickened forms, the vm rewrites the generic instruction into these once it has seen the operands
+	// and back when their guard fails
+	OP_ADD_NUM,
+	OP_EQUAL_NUM,
+	OP_NOT_EQUAL_NUM,
+	OP_GET_PROPERTY_MONO,	// while the property cache holds a single shape
+	OP_TAIL_CALL,			// return f(...), a closure takes over the current frame, always followed by OP_RETURN
+};
+
+#define OP_COUNT (OP_TAIL_CALL + 1)
+
+// in the same order as Op
+inline const char* OpNames[] = {
+	"OP_CONSTANT",
+	"OP_NIL",
+	"OP_TRUE",
+	"OP_FALSE",
+	"OP_POP",
+	"OP_GET_LOCAL",
+	"OP_SET_LOCAL",
+	"OP_GET_GLOBAL",
+	"OP_DEFINE_GLOBAL",
+	"OP_SET_GLOBAL",
+	"OP_GET_UPVALUE",
+	"OP_SET_UPVALUE",
+	"OP_GET_PROPERTY",
+	"OP_SET_PROPERTY",
+	"OP_EQUAL",
+	"OP_GREATER",
+	"OP_LESS",
+	"OP_ADD",
+	"OP_SUBTRACT",
+	"OP_MULTIPLY",
+	"OP_DIVIDE",
+	"OP_NOT",
+	"OP_NEGATE",
+	"OP_PRINT",
+	"OP_JUMP",
+	"OP_JUMP_IF_FALSE",
+	"OP_LOOP",
+	"OP_CALL",
+	"OP_CLOSURE",
+	"OP_CLOSE_UPVALUE",
+	"OP_RETURN",
+	"OP_CLASS",
+	"OP_NOT_EQUAL",
+	"OP_GREATER_EQUAL",
+	"OP_LESS_EQUAL",
+	"OP_POP_JUMP_IF_FALSE",
+	"OP_ADD_CONSTANT",
+	"OP_SUBTRACT_CONSTANT",
+	"OP_LESS_CONSTANT",
+	"OP_SET_LOCAL_POP",
+	"OP_SET_GLOBAL_POP",
+	"OP_JUMP_UNLESS_EQUAL",
+	"OP_JUMP_UNLESS_NOT_EQUAL",
+	"OP_JUMP_UNLESS_GREATER",
+	"OP_JUMP_UNLESS_LESS",
+	"OP_JUMP_UNLESS_GREATER_EQUAL",
+	"OP_JUMP_UNLESS_LESS_EQUAL",
+	"OP_JUMP_UNLESS_LESS_CONSTANT",
+	"OP_ADD_NUM",
+	"OP_EQUAL_NUM",
+	"OP_NOT_EQUAL_NUM",
+	"OP_GET_PROPERTY_MONO",
+	"OP_TAIL_CALL",
+};
+static_assert(sizeof(OpNames) / sizeof(OpNames[0]) == OP_COUNT, "OpNames is out of sync with Op");
+
+struct ObjShape;
+struct VM;
+
+#define PROPERTY_CACHE_SIZE 4
+
+struct PropertyCacheEntry
+{
+	ObjShape* shape; // shape of the instance before the access
+	ObjShape* newShape; // shape after a set that added the field, nullptr if the shape doesn't change
+	int slot; // slot of the field in the instance
+};
+
+// remembers the shapes a property instruction has seen, the first entry is checked before the others
+// once it's full the instruction is megamorphic and new shapes always take the slow path
+struct PropertyCache
+{
+	PropertyCacheEntry entries[PROPERTY_CACHE_SIZE];
+	int count;
+};
+
+// start of a run of bytecode that all came from the same source line
+struct LineStart
+{
+	uint32_t offset;
+	uint32_t line;
 };
 
 struct Chunk
 {
-	Chunk();
+	explicit Chunk(VM& vm);
 	~Chunk();
 
 	//template<typename T>
@@ -53,15 +165,19 @@ struct Chunk
 	//void WriteConstant(size_t constant, size_t line) { writeByte(static_cast<uint8_t>(constant), line); }
 	void writeByte(uint8_t byte, size_t line);
 	int addConstant(Value value);
+	size_t addPropertyCache();
+	void truncate(size_t count);
 
-	void disassemble(const char* name) const;
-	size_t disassembleInstruction(size_t offset) const;
+	void disassemble(const VM& vm, const char* name) const;
+	size_t disassembleInstruction(const VM& vm, size_t offset) const;
 
 	size_t count() const;
+	size_t getLine(size_t offset) const;
 
 	Blob<uint8_t> code;
-	Blob<size_t> lines;
+	Blob<LineStart> lines; // run length encoded, sorted by offset
 	Blob<Value> constants;
+	Blob<PropertyCache> propertyCaches;
 
 private:
 
@@ -69,6 +185,8 @@ private:
 	size_t jumpInstruction(const char* name, int sign, size_t offset) const;
 	size_t constantInstruction(const char* name, size_t offset) const;
 	size_t byteInstruction(const char* name, size_t offset) const;
+	size_t propertyInstruction(const char* name, size_t offset) const;
+	size_t globalInstruction(const VM& vm, const char* name, size_t offset) const;
 };
 
 
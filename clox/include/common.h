@@ -3,10 +3,29 @@
 #include <cstddef>
 #include <cstdint>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// pack Values into 8 byte NaN-boxed doubles instead of a 16 byte tagged union
+#define NAN_BOXING
+
+// hash tables probe 16 slots at a time on a byte per slot of hash bits instead of probing the entries linearly
+#define SWISS_TABLE
 
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
+// dispatch instructions through a table of label addresses instead of a switch,
+// only available on compilers that support the labels as values extension
+// off by default, bench/run.sh doesn't show it beating the switch
+#if defined(__GNUC__) || defined(__clang__)
+//#define COMPUTED_GOTO
+#endif
+
+// keeps rarely taken slow paths out of the hot functions that call them
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
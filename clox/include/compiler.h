@@ -5,5 +5,5 @@
 #include "vm.h"
 
 struct Chunk;
-ObjFunction* compile(const std::string& source);
-void markCompilerRoots();
+ObjFunction* compile(VM& vm, const std::string& source);
+void markCompilerRoots(VM& vm);
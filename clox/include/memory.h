@@ -4,25 +4,62 @@
 #include "value.h"
 
 struct Obj;
+struct VM;
 
-#define ALLOCATE(type, count) \
-	(type*)reallocate(NULL, 0, sizeof(type) * (count))
+// heap memory of a vm, counted towards its gc and served from its pool
+#define ALLOCATE(vm, type, count) \
+	(type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
 	((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-	reinterpret_cast<type*>(reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+	reinterpret_cast<type*>(reallocate(vm, pointer, sizeof(type) * (oldCount), \
 	sizeof(type) * (newCount)))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-	reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+	reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage();
-void freeObjects();
+#define POOL_GRANULARITY 16 // small allocations are rounded up to a multiple of this
+#define POOL_MAX_SIZE 256 // anything larger goes straight to malloc
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULARITY)
+#define POOL_PAGE_SIZE (64 * 1024)
+
+struct PoolSlot
+{
+	PoolSlot* next;
+};
+
+// size class segregated allocator for small allocations, every class has its own free list
+// slots are carved out of pages that are kept until the vm is freed
+struct Pool
+{
+	PoolSlot* freeLists[POOL_CLASSES];
+	char* pageTop;
+	char* pageEnd;
+	char* pages; // every page starts with a pointer to the page allocated before it
+};
+
+enum GcPhase
+{
+	GC_IDLE,
+	GC_MARK, // a full collection is tracing the heap a slice at a time
+	GC_SWEEP, // a full collection is freeing the detached object lists a slice at a time
+};
+
+#define GC_PAUSE_BUCKETS 6 // < 1us, < 10us, < 100us, < 1ms, < 10ms, the rest
+
+void* reallocate(VM& vm, void* pointer, size_t oldSize, size_t newSize);
+// for memory a vm owns outside of its objects, like bytecode and tables
+// it's counted towards the next collection, but growing it never starts one, its owner may not be reachable yet
+void countExternal(VM& vm, size_t oldSize, size_t newSize);
+void markObject(VM& vm, Obj* object);
+void markValue(VM& vm, Value value);
+void rememberObject(VM& vm, Obj* object);
+void collectGarbage(VM& vm);
+void collectYoungGarbage(VM& vm);
+void printGcStats(const VM& vm);
+void freeObjects(VM& vm);
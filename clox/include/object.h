@@ -3,8 +3,10 @@
 #include "common.h"
 
 #include "chunk.h"
+#include "memory.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #define OBJ_TYPE(value)		(AS_OBJ(value)->type)
 
@@ -13,6 +15,7 @@
 #define IS_FUNCTION(value)	isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)	isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)	isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)		isObjType(value, OBJ_ROPE)
 #define IS_STRING(value)	isObjType(value, OBJ_STRING)
 
 #define AS_CLASS(value)		((ObjClass*)AS_OBJ(value))
@@ -20,6 +23,7 @@
 #define AS_FUNCTION(value)	((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)	((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)	(((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)		((ObjRope*)AS_OBJ(value))
 #define AS_STRING(value)	((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)	(((ObjString*)AS_OBJ(value))->chars)
 
@@ -29,6 +33,8 @@ typedef enum {
 	OBJ_FUNCTION,
 	OBJ_INSTANCE,
 	OBJ_NATIVE,
+	OBJ_ROPE,
+	OBJ_SHAPE,
 	OBJ_STRING,
 	OBJ_UPVALUE,
 } ObjType;
@@ -40,6 +46,8 @@ inline const char* ObjTypeNames[] = {
 	"OBJ_FUNCTION",
 	"OBJ_INSTANCE",
 	"OBJ_NATIVE",
+	"OBJ_ROPE",
+	"OBJ_SHAPE",
 	"OBJ_STRING",
 	"OBJ_UPVALUE"
 };
@@ -47,10 +55,27 @@ inline const char* ObjTypeNames[] = {
 
 struct Obj {
 	ObjType type;
-	bool isMarked;
+	bool mark; // see isMarked()
+	bool isRemembered;
 	Obj* next;
 };
 
+// objects are marked when their mark equals vm.markValue, so flipping that unmarks the whole heap at once
+// objects stay marked once they survive a collection, so outside of a full collection marked means "old generation"
+inline bool isMarked(const VM& vm, const Obj* object)
+{
+	return object->mark == vm.markValue;
+}
+
+// has to follow every store of a reference into an object that may already be old (or black, while marking)
+inline void writeBarrier(VM& vm, Obj* object, Value value)
+{
+	if (isMarked(vm, object) && IS_OBJ(value) && !isMarked(vm, AS_OBJ(value)))
+	{
+		rememberObject(vm, object);
+	}
+}
+
 struct ObjFunction
 {
 	Obj obj;
@@ -58,9 +83,10 @@ struct ObjFunction
 	int upvalueCount;
 	Chunk chunk;
 	ObjString* name;
+	ObjClosure* closure; // without upvalues every closure would be the same, so they share this one
 };
 
-typedef Value(*NativeFn)(int argCount, Value* args);
+typedef Value(*NativeFn)(VM& vm, int argCount, Value* args);
 
 struct ObjNative
 {
@@ -68,11 +94,35 @@ struct ObjNative
 	NativeFn function;
 };
 
+// the characters are part of the same allocation, chars is declared with room for the terminator only
+// strings built at runtime aren't interned, they compare by hash and then by their characters
 struct ObjString {
 	Obj obj;
 	size_t length;
-	char* chars;
-	uint32_t hash;
+	uint32_t hash; // 0 until it's computed, interned strings always have it and runtime strings get it when compared
+	bool interned;
+	char chars[1];
+};
+
+// bytes allocated for a string of this many characters
+inline size_t stringSize(size_t length)
+{
+	return offsetof(ObjString, chars) + length + 1;
+}
+
+// lazy concatenation of two strings (or ropes), scripts see it as an ordinary string
+// the characters are only gathered when the string has to be compared
+#define ROPE_MIN_LENGTH 64 // shorter concatenations are copied right away
+#define ROPE_MAX_DEPTH 32 // nested right operands before the right one is flattened, bounds the copying recursion
+
+struct ObjRope
+{
+	Obj obj;
+	size_t length;
+	int depth; // right operands nested below this one, copying recurses into those and loops down the left ones
+	Value left;
+	Value right;
+	ObjString* flat; // the flat string once the rope has been flattened, left and right are dropped then
 };
 
 struct ObjUpvalue
@@ -83,38 +133,89 @@ struct ObjUpvalue
 	ObjUpvalue* next;
 };
 
+// the upvalues are part of the same allocation, like the characters of a string
 struct ObjClosure
 {
 	Obj obj;
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount;
+	ObjUpvalue* upvalues[1];
 };
 
+// bytes allocated for a closure with this many upvalues
+inline size_t closureSize(int upvalueCount)
+{
+	return offsetof(ObjClosure, upvalues) + sizeof(ObjUpvalue*) * upvalueCount;
+}
+
+// hidden class describing the field layout of instances
+// every shape adds one field to its parent, instances that got the same fields in the same order share a shape
+struct ObjShape
+{
+	Obj obj;
+	ObjShape* parent;
+	ObjString* name; // name of the field this shape adds, nullptr for the root shape
+	int fieldCount; // also the slot of the field this shape adds + 1
+	Table transitions; // field name -> shape with that field added
+};
+
+// new instances never reserve more than this many inline fields
+#define INSTANCE_INLINE_MAX 16
+
 struct ObjClass
 {
 	Obj obj;
 	ObjString* name;
+	ObjShape* shape; // root shape of the class' instances
+	int inlineFieldCount; // most fields seen on an instance so far, new instances reserve this many inline
 };
 
 struct ObjInstance
 {
 	Obj obj;
 	ObjClass* klass;
-	Table fields;
+	ObjShape* shape;
+	Value* fields; // points to the inline fields right after the instance, or to a heap array once those ran out
+	int fieldCapacity;
+	int inlineCapacity;
 };
 
-ObjClass* newClass(ObjString* name);
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction();
-ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, size_t length); // construct a string Obj and take ownership of the char array
-ObjString* copyString(const char* chars, size_t length); // construct a string Obj with a copy of the char array
-ObjUpvalue* newUpvalue(Value* slot);
+// called whenever an instance moves to a bigger shape, later instances of the class reserve that many fields inline
+static inline void updateInlineFieldCount(ObjClass* klass, const ObjShape* shape)
+{
+	if (klass->inlineFieldCount < shape->fieldCount && shape->fieldCount <= INSTANCE_INLINE_MAX)
+	{
+		klass->inlineFieldCount = shape->fieldCount;
+	}
+}
+
+ObjClass* newClass(VM& vm, ObjString* name);
+ObjClosure* newClosure(VM& vm, ObjFunction* function); // the function has to be reachable by the gc
+ObjFunction* newFunction(VM& vm);
+ObjInstance* newInstance(VM& vm, ObjClass* klass);
+int findField(const ObjShape* shape, const ObjString* name); // returns the slot of the field or -1
+bool getField(const ObjInstance* instance, const ObjString* name, Value* out_value);
+void setField(VM& vm, ObjInstance* instance, ObjString* name, Value value); // instance and value have to be reachable by the gc
+ObjNative* newNative(VM& vm, NativeFn function);
+ObjString* newString(VM& vm, size_t length); // an uninterned string with room for length chars, for the caller to fill in
+bool stringsEqual(ObjString* a, ObjString* b); // hashes runtime strings on first use
+uint32_t hashString(const char* key, size_t length);
+ObjString* copyString(VM& vm, const char* chars, size_t length); // construct a string Obj with a copy of the char array
+ObjUpvalue* newUpvalue(VM& vm, Value* slot);
+ObjRope* newRope(VM& vm, Value left, Value right); // left and right have to be reachable by the gc
+ObjString* flattenRope(VM& vm, ObjRope* rope); // the rope has to be reachable by the gc
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
-	return IS_OBJ(value) && value.as.obj->type == type;
+	return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+// ropes are strings as far as scripts are concerned
+static inline bool isString(Value value) {
+	return IS_STRING(value) || IS_ROPE(value);
+}
+
+static inline size_t stringLength(Value value) {
+	return IS_STRING(value) ? AS_STRING(value)->length : AS_ROPE(value)->length;
 }
 
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "chunk.h"
+
+// peephole pass over a finished chunk, only ever shrinks the code
+void optimizeChunk(Chunk& chunk);
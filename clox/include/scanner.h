@@ -31,6 +31,14 @@ struct Token
 	int line;
 };
 
-void initScanner(const std::string& source);
+// one per compilation, so several can scan at the same time
+struct Scanner
+{
+	const char* start;
+	const char* current;
+	int line;
+};
+
+void initScanner(Scanner& scanner, const std::string& source);
 
-Token scanToken();
+Token scanToken(Scanner& scanner);
@@ -3,6 +3,8 @@
 #include "common.h"
 #include "value.h"
 
+struct VM;
+
 
 
 
@@ -14,6 +16,9 @@ typedef struct {
 class Table {
 public:
 	Table() = default;
+	explicit Table(VM& vm) : m_vm(&vm) {}
+	Table(const Table& other) = delete;
+	Table& operator=(const Table& other) = delete;
 	~Table();
 
 	// operations
@@ -24,20 +29,38 @@ public:
 	void addAll(Table& to) const;
 
 	ObjString* findString(const char* chars, size_t length, uint32_t hash) const;
-	void removeWhite();
-	void mark();
+	// also compacts the table, it's the weak string table that loses most keys
+	void removeWhite(const VM& vm);
+	// rebuilds the table when it's mostly tombstones or much bigger than its keys need
+	// del doesn't do this itself so it's safe to delete while walking the table
+	void compact();
+	void mark(VM& vm);
 	// getters
 	size_t count() const { return m_count; }
 	size_t capacity() const { return m_capacity; }
 
 private:
+	VM* m_vm = nullptr; // the vm whose gc the entries count towards
+
+#ifdef SWISS_TABLE
+	void resize(size_t capacity);
+	size_t findSlot(const ObjString* key) const; // returns m_capacity if the key isn't there
 
+	size_t m_count = 0;
+	size_t m_capacity = 0; // a power of two, and a whole number of 16 slot groups
+	size_t m_tombstones = 0;
+	// one allocation, split into the three arrays
+	int8_t* m_control = nullptr; // low 7 bits of the hash of every full slot, or CONTROL_EMPTY/CONTROL_DELETED
+	ObjString** m_keys = nullptr;
+	Value* m_values = nullptr;
+#else
 	void adjustCapacity(size_t capacity);
 
 
 	size_t m_count = 0;
 	size_t m_capacity = 0;
 	Entry* m_entries = nullptr;
+#endif
 };
 
 
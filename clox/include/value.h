@@ -1,15 +1,55 @@
 ﻿#pragma once
 
+#include <bit>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// every non-number value hides in the payload of a quiet NaN:
+// objects set the sign bit and store the pointer in the low 48 bits, nil/true/false use small tags
+#define SIGN_BIT	static_cast<uint64_t>(0x8000000000000000)
+#define QNAN		static_cast<uint64_t>(0x7ffc000000000000)
+
+#define TAG_NIL		1 // 01
+#define TAG_FALSE	2 // 10
+#define TAG_TRUE	3 // 11
+#define TAG_UNDEFINED	4 // 100, never visible to scripts
+
+typedef uint64_t Value;
+
+bool valuesEqual(Value a, Value b);
+
+#define FALSE_VAL			static_cast<Value>(QNAN | TAG_FALSE)
+#define TRUE_VAL			static_cast<Value>(QNAN | TAG_TRUE)
+
+#define IS_BOOL(value)		(((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)		((value) == NIL_VAL)
+#define IS_UNDEFINED(value)	((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)	(((value) & QNAN) != QNAN)
+#define IS_OBJ(value)		(((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)		((value) == TRUE_VAL)
+#define AS_NUMBER(value)	std::bit_cast<double>(static_cast<Value>(value))
+#define AS_OBJ(value)		reinterpret_cast<Obj*>(static_cast<uintptr_t>((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)			((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL				static_cast<Value>(QNAN | TAG_NIL)
+#define UNDEFINED_VAL		static_cast<Value>(QNAN | TAG_UNDEFINED)
+#define NUMBER_VAL(num)		std::bit_cast<Value>(static_cast<double>(num))
+#define OBJ_VAL(obj)		static_cast<Value>(SIGN_BIT | QNAN | static_cast<uint64_t>(reinterpret_cast<uintptr_t>(obj)))
+
+#else
+
 typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
 	VAL_OBJ,
+	VAL_UNDEFINED, // marks global slots that haven't been defined yet, never visible to scripts
 } ValueType;
 
 typedef struct {
@@ -27,6 +67,7 @@ bool valuesEqual(Value a, Value b);
 
 #define IS_BOOL(value)		((value).type == VAL_BOOL)
 #define IS_NIL(value)		((value).type == VAL_NIL)
+#define IS_UNDEFINED(value)	((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)	((value).type == VAL_NUMBER)
 #define IS_OBJ(value)		((value).type == VAL_OBJ)
 
@@ -48,6 +89,12 @@ bool valuesEqual(Value a, Value b);
 #define	NIL_VAL				Value{VAL_NIL, {.number = 0}}
 #define NUMBER_VAL(value)	Value{VAL_NUMBER, {.number = value}}
 #define OBJ_VAL(object)		Value{VAL_OBJ, {.obj = reinterpret_cast<Obj*>(object)}}
+#define UNDEFINED_VAL		Value{VAL_UNDEFINED, {.number = 0}}
+
+#endif
+
+// both checks are evaluated, so the pair costs a single branch
+#define ARE_NUMBERS(a, b)	(IS_NUMBER(a) & IS_NUMBER(b))
 
 
 void printValue(const Value& value);
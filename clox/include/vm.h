@@ -2,15 +2,18 @@
 #include <cstdint>
 #include <string>
 
+#include "blob.h"
 #include "table.h"
 #include "value.h"
 
 struct ObjUpvalue;
 struct ObjClosure;
 struct Chunk;
+struct Parser;
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_INITIAL 8
+#define FRAMES_DEFAULT_MAX 1024 // recursion limit unless --max-frames says otherwise
+#define STACK_INITIAL UINT8_COUNT
 
 struct CallFrame
 {
@@ -21,26 +24,60 @@ struct CallFrame
 
 struct VM
 {
-	VM() = default;
+	// the tables and blobs count towards this vm's gc
+	VM() : globals(*this), globalValues(*this), globalNames(*this), strings(*this) {}
 	~VM() = default;
 
-	CallFrame frames[FRAMES_MAX];
+	// both stacks start small and are reallocated when they fill up, see growStack()
+	CallFrame* frames;
 	size_t frameCount;
-	
-	Value stack[STACK_MAX];
+	size_t frameCapacity;
+	size_t maxFrames;
+
+	Value* stack;
 	Value* stackTop;
-	Table globals;
+	Value* stackEnd;
+	Table globals; // global name -> index into globalValues, only used when resolving names
+	Blob<Value> globalValues; // UNDEFINED_VAL until the global is defined
+	Blob<ObjString*> globalNames; // name of every global slot, for error messages
 	Table strings;
 	ObjUpvalue* openUpvalues;
+	Parser* parser; // the compilation that is running on this vm, if any, its functions are gc roots
+
+	Pool pool;
+	size_t bytesAllocated; // in pool size classes, so this is what the heap actually holds on to
+	size_t nextGC; // full collection threshold
+	size_t nextMinorGC; // young generation collection threshold
+	size_t nextGCStep; // next incremental step of a running full collection
+	Obj* objects; // young generation, everything allocated since the last collection
+	Obj* oldObjects; // survivors of earlier collections
+
+	GcPhase gcPhase;
+	bool markValue;
+	Obj* sweepObjects; // detached lists that a full collection is still sweeping
+	Obj* sweepOldObjects;
+	int gcPauseBudget; // microseconds a single incremental gc step aims to stay under
 
-	size_t bytesAllocated;
-	size_t nextGC;
-	Obj* objects;
+	bool gcStats; // print the pause distribution on exit
+	size_t gcPauses[GC_PAUSE_BUCKETS];
+	double gcMaxPause; // microseconds
+	double gcTotalPause;
+
+	// old objects that were written a reference to a young object since the last collection
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** rememberedSet;
 
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
 
+	bool traceExecution; // print the stack and every instruction while running
+	bool opStats; // count which instructions run after each other, printed on exit
+	size_t* opPairs; // OP_COUNT * OP_COUNT counters, allocated on first use
+	size_t* opTriples; // OP_COUNT * OP_COUNT * OP_COUNT counters
+	int previousOps[2]; // the last two opcodes that ran, -1 before the first
+	bool printCode; // disassemble every chunk after compiling it
 };
 
 enum InterpretResult
@@ -50,13 +87,14 @@ enum InterpretResult
 	INTERPRET_RUNTIME_ERROR
 };
 
-extern VM vm;
-
+void initVM(VM& vm);
+void freeVM(VM& vm);
+void printOpStats(const VM& vm);
 
-void initVM();
-void freeVM();
+InterpretResult interpret(VM& vm, const std::string& source);
 
-InterpretResult interpret(const std::string& source);
+// returns the slot of the global with this name, reserving an undefined slot on first use
+size_t globalSlot(VM& vm, ObjString* name);
 
-void push(Value value);
-Value pop();
+void push(VM& vm, Value value);
+Value pop(VM& vm);
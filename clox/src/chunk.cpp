@@ -8,8 +8,10 @@
 #include "util.h"
 #include "vm.h"
 
-Chunk::Chunk()
-= default;
+Chunk::Chunk(VM& vm)
+	: code(vm), lines(vm), constants(vm), propertyCaches(vm)
+{
+}
 
 Chunk::~Chunk()
 = default;
@@ -17,19 +19,35 @@ Chunk::~Chunk()
 void Chunk::writeByte(const uint8_t byte, const size_t line)
 {
 	code.write(byte);
-	while (lines.size() < code.size()) { lines.write(line); } // nts: optimization possible here
+
+	// only start a new run when the line changes
+	if (lines.size() > 0 && lines[lines.size() - 1].line == line) return;
+	lines.write(LineStart{ static_cast<uint32_t>(code.size() - 1), static_cast<uint32_t>(line) });
 }
 
+// drops trailing code along with the line runs that only covered it
+void Chunk::truncate(const size_t count)
+{
+	code.truncate(count);
+	while (lines.size() > 0 && lines[lines.size() - 1].offset >= count)
+	{
+		lines.truncate(lines.size() - 1);
+	}
+}
 
 int Chunk::addConstant(const Value value)
 {
-	push(value);
 	constants.write(value);
-	pop();
 	return static_cast<int>(constants.size() - 1);
 }
 
-void Chunk::disassemble(const char* name) const
+size_t Chunk::addPropertyCache()
+{
+	propertyCaches.write(PropertyCache{});
+	return propertyCaches.size() - 1;
+}
+
+void Chunk::disassemble(const VM& vm, const char* name) const
 {
 	printf("== %s ==\n", name);
 	if (constants.size() > 0)
@@ -49,7 +67,7 @@ void Chunk::disassemble(const char* name) const
 
 	for (size_t offset = 0; offset < code.size();)
 	{
-		offset = disassembleInstruction(offset);
+		offset = disassembleInstruction(vm, offset);
 	}
 	printf("\n");
 }
@@ -59,3 +77,23 @@ size_t Chunk::count() const
 	return code.size();
 }
 
+size_t Chunk::getLine(const size_t offset) const
+{
+	// binary search for the last run that starts at or before offset
+	size_t low = 0;
+	size_t high = lines.size();
+	while (high - low > 1)
+	{
+		const size_t mid = low + (high - low) / 2;
+		if (lines[mid].offset <= offset)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return lines[low].line;
+}
+
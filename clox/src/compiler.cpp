@@ -1,17 +1,12 @@
 #include "compiler.h"
 
+#include <cmath>
+
 #include "chunk.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 
-struct Parser
-{
-	Token current;
-	Token previous;
-	bool hadError;
-	bool panicMode;
-};
-
 enum Precedence
 {
 	PREC_NONE,
@@ -27,7 +22,9 @@ enum Precedence
 	PREC_PRIMARY
 };
 
-using ParseFn = void(*)(bool canAssign);
+struct Parser;
+
+using ParseFn = void(*)(Parser& parser, bool canAssign);
 
 struct ParseRule {
 	ParseFn prefix;
@@ -47,6 +44,16 @@ struct Upvalue
 	bool isLocal;
 };
 
+// an instruction that pushes a value known at compile time
+struct Literal
+{
+	size_t start;
+	size_t end;
+	Value value;
+};
+
+#define LITERAL_MAX 16
+
 enum FunctionType {
 	TYPE_FUNCTION,
 	TYPE_SCRIPT
@@ -61,18 +68,36 @@ struct Compiler {
 	int localCount;
 	Upvalue upvalues[UINT8_COUNT];
 	int scopeDepth;
+
+	// constant folding state, the trailing run of literals can be rewritten as long as no jump lands inside it
+	Literal literals[LITERAL_MAX];
+	int literalCount;
+	size_t jumpTarget;
+	size_t numberOp; // start of the last instruction that always leaves a number on the stack
+	size_t comparison; // start of the last comparison, a condition that ends in one gets fused into its jump
+	size_t lastCall; // start of the last OP_CALL, a return of it becomes a tail call
 };
 
-Parser parser;
-Compiler* current = nullptr;
-Chunk* compilingChunk;
+// everything one compilation works on, threaded through the parse functions so several can run at the same time
+struct Parser
+{
+	explicit Parser(VM& vm) : vm(vm) {}
 
-static Chunk& currentChunk()
+	VM& vm;
+	Scanner scanner;
+	Compiler* compiler; // the innermost function being compiled
+	Token current;
+	Token previous;
+	bool hadError;
+	bool panicMode;
+};
+
+static Chunk& currentChunk(Parser& parser)
 {
-	return current->function->chunk;
+	return parser.compiler->function->chunk;
 }
 
-static void errorAt(const Token& token, const char* message)
+static void errorAt(Parser& parser, const Token& token, const char* message)
 {
 	if (parser.panicMode) return;
 	parser.panicMode = true;
@@ -96,191 +121,429 @@ static void errorAt(const Token& token, const char* message)
 	parser.hadError = true;
 }
 
-static void error(const char* message)
+static void error(Parser& parser, const char* message)
 {
-	errorAt(parser.previous, message);
+	errorAt(parser, parser.previous, message);
 }
 
-static void errorAtCurrent(const char* message)
+static void errorAtCurrent(Parser& parser, const char* message)
 {
-	errorAt(parser.current, message);
+	errorAt(parser, parser.current, message);
 }
 
-static void advance()
+static void advance(Parser& parser)
 {
 	parser.previous = parser.current;
 
 	while (true)
 	{
-		parser.current = scanToken();
+		parser.current = scanToken(parser.scanner);
 		if (parser.current.type != TOKEN_ERROR) break;
-		errorAtCurrent(parser.current.start);
+		errorAtCurrent(parser, parser.current.start);
 	}
 }
 
-static void consume(const TokenType type, const char* message)
+static void consume(Parser& parser, const TokenType type, const char* message)
 {
 	if (parser.current.type == type)
 	{
-		advance();
+		advance(parser);
 		return;
 	}
 
-	errorAtCurrent(message);
+	errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser& parser, TokenType type)
 {
 	return parser.current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser& parser, TokenType type)
 {
-	if (!check(type)) return false;
-	advance();
+	if (!check(parser, type)) return false;
+	advance(parser);
 	return true;
 }
 
-static void emitByte(const uint8_t byte)
+static void emitByte(Parser& parser, const uint8_t byte)
 {
-	currentChunk().writeByte(byte, parser.previous.line);
+	currentChunk(parser).writeByte(byte, parser.previous.line);
 }
 
-static void emitBytes(const uint8_t byte1, const uint8_t byte2)
+static void emitBytes(Parser& parser, const uint8_t byte1, const uint8_t byte2)
 {
-	emitByte(byte1);
-	emitByte(byte2);
+	emitByte(parser, byte1);
+	emitByte(parser, byte2);
 }
 
-static void emitLoop(size_t loopStart)
+static void emitShort(Parser& parser, const uint16_t value)
 {
-	emitByte(OP_LOOP);
+	emitByte(parser, (value >> 8) & 0xff);
+	emitByte(parser, value & 0xff);
+}
+
+static void emitLoop(Parser& parser, size_t loopStart)
+{
+	emitByte(parser, OP_LOOP);
 
-	size_t offset = currentChunk().code.size() - loopStart + 2;
-	if (offset > UINT16_MAX) error("Loop body too large.");
+	size_t offset = currentChunk(parser).code.size() - loopStart + 2;
+	if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-	emitByte((offset >> 8) & 0xff);
-	emitByte(offset & 0xff);
+	emitByte(parser, (offset >> 8) & 0xff);
+	emitByte(parser, offset & 0xff);
 }
 
 // emits an instruction and returns the address/offset of where the address to jump to is going to be stored
-static size_t emitJump(uint8_t instruction)
+static size_t emitJump(Parser& parser, uint8_t instruction)
 {
-	emitByte(instruction);
-	emitByte(0xff);
-	emitByte(0xff);
-	return currentChunk().code.size() - 2;
+	emitByte(parser, instruction);
+	emitByte(parser, 0xff);
+	emitByte(parser, 0xff);
+	return currentChunk(parser).code.size() - 2;
 }
 
-static void emitReturn()
+static void emitReturn(Parser& parser)
 {
-	emitByte(OP_NIL);
-	emitByte(OP_RETURN);
+	emitByte(parser, OP_NIL);
+	emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(const Value value)
+static uint8_t makeConstant(Parser& parser, const Value value)
 {
-	const int constant = currentChunk().addConstant(value);
+	const int constant = currentChunk(parser).addConstant(value);
 	if (constant > UINT8_MAX)
 	{
-		error("Too many constants in one chunk.");
+		error(parser, "Too many constants in one chunk.");
 		return 0;
 	}
 
 	return static_cast<uint8_t>(constant);
 }
 
-static void emitConstant(const Value value)
+static void emitConstant(Parser& parser, const Value value)
 {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static void patchJump(size_t offset)
+// code before a jump target can be reached from elsewhere, so it isn't folded away
+static void markJumpTarget(Parser& parser)
 {
-	const int jump = static_cast<int>(currentChunk().code.size()) - static_cast<int>(offset) - 2;
+	parser.compiler->jumpTarget = currentChunk(parser).count();
+}
+
+static void patchJump(Parser& parser, size_t offset)
+{
+	const int jump = static_cast<int>(currentChunk(parser).code.size()) - static_cast<int>(offset) - 2;
 
 	if (jump > UINT16_MAX)
 	{
-		error("Too much code to jump over");
+		error(parser, "Too much code to jump over");
+	}
+
+	currentChunk(parser).code[offset] = (jump >> 8) & 0xff;
+	currentChunk(parser).code[offset + 1] = jump & 0xff;
+	markJumpTarget(parser);
+}
+
+static void emitLiteral(Parser& parser, const Value value)
+{
+	const size_t start = currentChunk(parser).count();
+	if (IS_NIL(value))
+	{
+		emitByte(parser, OP_NIL);
+	}
+	else if (IS_BOOL(value))
+	{
+		emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	}
+	else
+	{
+		emitConstant(parser, value);
+	}
+
+	// a literal only extends the run if nothing was emitted since the previous one
+	Literal* literals = parser.compiler->literals;
+	if (parser.compiler->literalCount > 0 && literals[parser.compiler->literalCount - 1].end != start)
+	{
+		parser.compiler->literalCount = 0;
+	}
+	if (parser.compiler->literalCount == LITERAL_MAX)
+	{
+		memmove(literals, literals + 1, (LITERAL_MAX - 1) * sizeof(Literal));
+		parser.compiler->literalCount--;
+	}
+	literals[parser.compiler->literalCount++] = Literal{ start, currentChunk(parser).count(), value };
+}
+
+// returns the last count literals if they are the very last instructions and safe to rewrite
+static const Literal* trailingLiterals(Parser& parser, const int count)
+{
+	if (parser.compiler->literalCount < count) return nullptr;
+
+	const Literal* literals = &parser.compiler->literals[parser.compiler->literalCount - count];
+	if (literals[count - 1].end != currentChunk(parser).count()) return nullptr;
+	if (literals[0].start < parser.compiler->jumpTarget) return nullptr;
+	return literals;
+}
+
+// removes the trailing literals, along with their constants when nothing was added to the pool after them
+static void dropLiterals(Parser& parser, const int count)
+{
+	Chunk& chunk = currentChunk(parser);
+	parser.compiler->literalCount -= count;
+	const Literal* literals = &parser.compiler->literals[parser.compiler->literalCount];
+
+	for (int i = count - 1; i >= 0; i--)
+	{
+		const size_t start = literals[i].start;
+		if (chunk.code[start] == OP_CONSTANT && chunk.code[start + 1] == chunk.constants.size() - 1)
+		{
+			chunk.constants.truncate(chunk.constants.size() - 1);
+		}
+	}
+	chunk.truncate(literals[0].start);
+	if (parser.compiler->comparison >= chunk.count()) parser.compiler->comparison = SIZE_MAX;
+}
+
+static bool foldUnary(Parser& parser, const Op op)
+{
+	const Literal* operand = trailingLiterals(parser, 1);
+	if (operand == nullptr) return false;
+
+	const Value value = operand->value;
+	Value result;
+	if (op == OP_NOT)
+	{
+		result = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+	}
+	else if (op == OP_NEGATE && IS_NUMBER(value))
+	{
+		result = NUMBER_VAL(-AS_NUMBER(value));
+	}
+	else
+	{
+		return false; // leave the type error to the vm
+	}
+
+	dropLiterals(parser, 1);
+	emitLiteral(parser, result);
+	return true;
+}
+
+static bool foldBinary(Parser& parser, const Op op)
+{
+	const Literal* operands = trailingLiterals(parser, 2);
+	if (operands == nullptr) return false;
+
+	const Value a = operands[0].value;
+	const Value b = operands[1].value;
+	if (op == OP_EQUAL || op == OP_NOT_EQUAL)
+	{
+		dropLiterals(parser, 2);
+		emitLiteral(parser, BOOL_VAL(valuesEqual(a, b) == (op == OP_EQUAL)));
+		return true;
+	}
+
+	if (op == OP_ADD && IS_OBJ(a) && IS_STRING(a) && IS_OBJ(b) && IS_STRING(b))
+	{
+		// copy both halves out first, dropping the literals unroots them
+		std::string chars(AS_CSTRING(a), AS_STRING(a)->length);
+		chars.append(AS_CSTRING(b), AS_STRING(b)->length);
+		dropLiterals(parser, 2);
+		emitLiteral(parser, OBJ_VAL(copyString(parser.vm, chars.c_str(), chars.size())));
+		return true;
 	}
 
-	currentChunk().code[offset] = (jump >> 8) & 0xff;
-	currentChunk().code[offset + 1] = jump & 0xff;
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
 
+	const double x = AS_NUMBER(a);
+	const double y = AS_NUMBER(b);
+	Value result;
+	switch (op)
+	{
+	case OP_GREATER:	result = BOOL_VAL(x > y); break;
+	case OP_LESS:		result = BOOL_VAL(x < y); break;
+	case OP_ADD:		result = NUMBER_VAL(x + y); break;
+	case OP_SUBTRACT:	result = NUMBER_VAL(x - y); break;
+	case OP_MULTIPLY:	result = NUMBER_VAL(x * y); break;
+	case OP_DIVIDE:		result = NUMBER_VAL(x / y); break;
+	case OP_GREATER_EQUAL:	result = BOOL_VAL(!(x < y)); break;
+	case OP_LESS_EQUAL:		result = BOOL_VAL(!(x > y)); break;
+	default: return false;
+	}
+
+	dropLiterals(parser, 2);
+	emitLiteral(parser, result);
+	return true;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type)
+// x * 1, x / 1 and x - 0 leave every number as is (-0 and nan included) but would skip the type check,
+// so they're only dropped when x comes straight out of an instruction that always produces a number.
+// x + 0 is left alone since it turns -0 into 0
+static bool foldIdentity(Parser& parser, const Op op)
 {
-	compiler->enclosing = current;
+	const Literal* operand = trailingLiterals(parser, 1);
+	if (operand == nullptr || !IS_NUMBER(operand->value)) return false;
+	if (operand->start != parser.compiler->numberOp + 1 || parser.compiler->numberOp < parser.compiler->jumpTarget) return false;
+
+	const double y = AS_NUMBER(operand->value);
+	const bool identity = ((op == OP_MULTIPLY || op == OP_DIVIDE) && y == 1.0)
+		|| (op == OP_SUBTRACT && y == 0.0 && !std::signbit(y));
+	if (!identity) return false;
+
+	dropLiterals(parser, 1);
+	return true;
+}
+
+// emits an operator, or evaluates it right away when its operands are already known
+static void emitOperator(Parser& parser, const Op op)
+{
+	if (op == OP_NOT || op == OP_NEGATE)
+	{
+		if (foldUnary(parser, op)) return;
+	}
+	else if (foldBinary(parser, op) || foldIdentity(parser, op))
+	{
+		return;
+	}
+
+	const size_t start = currentChunk(parser).count();
+	emitByte(parser, op);
+	if (op == OP_SUBTRACT || op == OP_MULTIPLY || op == OP_DIVIDE || op == OP_NEGATE)
+	{
+		parser.compiler->numberOp = start;
+	}
+	if (op == OP_EQUAL || op == OP_NOT_EQUAL || op == OP_GREATER || op == OP_LESS || op == OP_GREATER_EQUAL || op == OP_LESS_EQUAL)
+	{
+		parser.compiler->comparison = start;
+	}
+}
+
+// emits the jump that skips a statement when its condition is false, popping the condition on both paths
+// a condition that ends in a comparison is fused into the jump, so the bool never reaches the stack
+static size_t emitConditionJump(Parser& parser)
+{
+	Chunk& chunk = currentChunk(parser);
+	const size_t comparison = parser.compiler->comparison;
+	if (comparison != chunk.count() - 1 || comparison < parser.compiler->jumpTarget)
+	{
+		return emitJump(parser, OP_POP_JUMP_IF_FALSE);
+	}
+
+	uint8_t jump;
+	switch (chunk.code[comparison])
+	{
+	case OP_EQUAL:			jump = OP_JUMP_UNLESS_EQUAL; break;
+	case OP_NOT_EQUAL:		jump = OP_JUMP_UNLESS_NOT_EQUAL; break;
+	case OP_GREATER:		jump = OP_JUMP_UNLESS_GREATER; break;
+	case OP_LESS:			jump = OP_JUMP_UNLESS_LESS; break;
+	case OP_GREATER_EQUAL:	jump = OP_JUMP_UNLESS_GREATER_EQUAL; break;
+	case OP_LESS_EQUAL:		jump = OP_JUMP_UNLESS_LESS_EQUAL; break;
+	default: return emitJump(parser, OP_POP_JUMP_IF_FALSE); // unreachable
+	}
+
+	// the fused jump does the comparison, so runtime errors have to report the comparison's line rather than the ')'
+	const size_t line = chunk.getLine(comparison);
+	chunk.truncate(comparison);
+	parser.compiler->comparison = SIZE_MAX;
+	chunk.writeByte(jump, line);
+	chunk.writeByte(0xff, line);
+	chunk.writeByte(0xff, line);
+	return chunk.count() - 2;
+}
+
+static void initCompiler(Parser& parser, Compiler* compiler, FunctionType type)
+{
+	compiler->enclosing = parser.compiler;
 	compiler->function = nullptr;
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
-	compiler->function = newFunction();
-	current = compiler;
+	compiler->literalCount = 0;
+	compiler->jumpTarget = 0;
+	compiler->numberOp = SIZE_MAX;
+	compiler->comparison = SIZE_MAX;
+	compiler->lastCall = SIZE_MAX;
+	compiler->function = newFunction(parser.vm);
+	parser.compiler = compiler;
 	if (type != TYPE_SCRIPT)
 	{
-		current->function->name = copyString(parser.previous.start, parser.previous.length);
+		parser.compiler->function->name = copyString(parser.vm, parser.previous.start, parser.previous.length);
 	}
 
-	Local* local = &current->locals[current->localCount++];
+	Local* local = &parser.compiler->locals[parser.compiler->localCount++];
 	local->depth = 0;
 	local->isCaptured = false;
 	local->name.start = "";
 	local->name.length = 0;
 }
 
-static ObjFunction* endCompiler()
+static ObjFunction* endCompiler(Parser& parser)
 {
-	auto& code = currentChunk().code;
+	auto& code = currentChunk(parser).code;
 	if (code.size() == 0 || code[code.size() - 1] != OP_RETURN)
 	{
-		emitReturn();
+		emitReturn(parser);
 	}
-	ObjFunction* function = current->function;
-#ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError)
+	optimizeChunk(currentChunk(parser));
+	ObjFunction* function = parser.compiler->function;
+	// the function may have been promoted while it was being compiled
+	rememberObject(parser.vm, reinterpret_cast<Obj*>(function));
+	if (parser.vm.printCode && !parser.hadError)
 	{
-		currentChunk().disassemble(function->name != nullptr ? function->name->chars : "<script>");
+		currentChunk(parser).disassemble(parser.vm, function->name != nullptr ? function->name->chars : "<script>");
 	}
-#endif
 
-	current = current->enclosing;
+	parser.compiler = parser.compiler->enclosing;
 	return function;
 }
 
-static void beginScope()
+static void beginScope(Parser& parser)
 {
-	current->scopeDepth++;
+	parser.compiler->scopeDepth++;
 }
 
-static void endScope()
+static void endScope(Parser& parser)
 {
-	current->scopeDepth--;
+	parser.compiler->scopeDepth--;
 
-	while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
+	while (parser.compiler->localCount > 0 && parser.compiler->locals[parser.compiler->localCount - 1].depth > parser.compiler->scopeDepth)
 	{
-		if (current->locals[current->localCount - 1].isCaptured)
+		if (parser.compiler->locals[parser.compiler->localCount - 1].isCaptured)
 		{
-			emitByte(OP_CLOSE_UPVALUE);
+			emitByte(parser, OP_CLOSE_UPVALUE);
 		}
 		else
 		{
-			emitByte(OP_POP);
+			emitByte(parser, OP_POP);
 		}
-		current->localCount--;
+		parser.compiler->localCount--;
 	}
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser& parser);
+static void statement(Parser& parser);
+static void declaration(Parser& parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser& parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token* name)
+static uint8_t identifierConstant(Parser& parser, Token* name)
 {
-	return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+	return makeConstant(parser, OBJ_VAL(copyString(parser.vm, name->start, name->length)));
+}
+
+// resolves a global by name to its slot in vm.globalValues
+static uint16_t identifierGlobal(Parser& parser, Token* name)
+{
+	const size_t slot = globalSlot(parser.vm, copyString(parser.vm, name->start, name->length));
+	if (slot > UINT16_MAX)
+	{
+		error(parser, "Too many global variables.");
+		return 0;
+	}
+
+	return static_cast<uint16_t>(slot);
 }
 
 static bool identifiersEqual(Token* a, Token* b)
@@ -289,7 +552,7 @@ static bool identifiersEqual(Token* a, Token* b)
 	return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name)
+static int resolveLocal(Parser& parser, Compiler* compiler, Token* name)
 {
 	for (int i = compiler->localCount - 1; i >= 0; i--)
 	{
@@ -298,7 +561,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
 		{
 			if (local->depth == -1)
 			{
-				error("Can't read local variable in its own initializer.");
+				error(parser, "Can't read local variable in its own initializer.");
 			}
 			return i;
 		}
@@ -307,7 +570,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
 	return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Parser& parser, Compiler* compiler, uint8_t index, bool isLocal)
 {
 	int upvalueCount = compiler->function->upvalueCount;
 
@@ -322,7 +585,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 
 	if (upvalueCount == UINT8_COUNT)
 	{
-		error("Too many closure variables in function.");
+		error(parser, "Too many closure variables in function.");
 		return 0;
 	}
 
@@ -331,383 +594,402 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 	return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name)
+static int resolveUpvalue(Parser& parser, Compiler* compiler, Token* name)
 {
 	if (compiler->enclosing == nullptr) return -1;
 
-	int local = resolveLocal(compiler->enclosing, name);
+	int local = resolveLocal(parser, compiler->enclosing, name);
 	if (local != -1)
 	{
 		compiler->enclosing->locals[local].isCaptured = true;
-		return addUpvalue(compiler, (uint8_t)local, true);
+		return addUpvalue(parser, compiler, (uint8_t)local, true);
 	}
 
-	int upvalue = resolveUpvalue(compiler->enclosing, name);
+	int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
 	if (upvalue != -1)
 	{
-		return addUpvalue(compiler, static_cast<uint8_t>(upvalue), false);
+		return addUpvalue(parser, compiler, static_cast<uint8_t>(upvalue), false);
 	}
 
 	return -1;
 	// todo: recurse into surrounding scopes?!
 }
 
-static void addLocal(Token name)
+static void addLocal(Parser& parser, Token name)
 {
-	if (current->localCount == UINT8_COUNT)
+	if (parser.compiler->localCount == UINT8_COUNT)
 	{
-		error("Too many local variables in closure.");
+		error(parser, "Too many local variables in closure.");
 		return;
 	}
 
-	Local* local = &current->locals[current->localCount++];
+	Local* local = &parser.compiler->locals[parser.compiler->localCount++];
 	local->name = name;
 	local->depth = -1;
 	local->isCaptured = false;
 }
 
-static void declareVariable()
+static void declareVariable(Parser& parser)
 {
-	if (current->scopeDepth == 0) return;
+	if (parser.compiler->scopeDepth == 0) return;
 
 	Token* name = &parser.previous;
-	for (int i = current->localCount - 1; i >= 0; i--)
+	for (int i = parser.compiler->localCount - 1; i >= 0; i--)
 	{
-		Local* local = &current->locals[i];
-		if (local->depth != -1 && local->depth < current->scopeDepth)
+		Local* local = &parser.compiler->locals[i];
+		if (local->depth != -1 && local->depth < parser.compiler->scopeDepth)
 		{
 			break;
 		}
 
 		if (identifiersEqual(name, &local->name))
 		{
-			error("Already a variable with this name in this scope.");
+			error(parser, "Already a variable with this name in this scope.");
 		}
 	}
 
 
-	addLocal(*name);
+	addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static uint16_t parseVariable(Parser& parser, const char* errorMessage)
 {
-	consume(TOKEN_IDENTIFIER, errorMessage);
+	consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-	declareVariable();
-	if (current->scopeDepth > 0) return 0;
+	declareVariable(parser);
+	if (parser.compiler->scopeDepth > 0) return 0;
 
-	return identifierConstant(&parser.previous);
+	return identifierGlobal(parser, &parser.previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser& parser)
 {
-	if (current->scopeDepth == 0) return;
-	current->locals[current->localCount - 1].depth = current->scopeDepth;
+	if (parser.compiler->scopeDepth == 0) return;
+	parser.compiler->locals[parser.compiler->localCount - 1].depth = parser.compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser& parser, uint16_t global)
 {
-	if (current->scopeDepth > 0) {
-		markInitialized();
+	if (parser.compiler->scopeDepth > 0) {
+		markInitialized(parser);
 		return;
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitByte(parser, OP_DEFINE_GLOBAL);
+	emitShort(parser, global);
 }
 
-static uint8_t argumentList()
+static uint8_t argumentList(Parser& parser)
 {
 	uint8_t argCount = 0;
-	if (!check(TOKEN_RIGHT_PAREN))
+	if (!check(parser, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
-			expression();
-			if (argCount == 255) { error("Can't have more than 255 arguments."); }
+			expression(parser);
+			if (argCount == 255) { error(parser, "Can't have more than 255 arguments."); }
 			argCount++;
-		} while (match(TOKEN_COMMA));
+		} while (match(parser, TOKEN_COMMA));
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
 	return argCount;
 }
 
-static void and_(bool)
+static void and_(Parser& parser, bool)
 {
-	size_t endJump = emitJump(OP_JUMP_IF_FALSE);
+	size_t endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-	emitByte(OP_POP);
-	parsePrecedence(PREC_AND);
+	emitByte(parser, OP_POP);
+	parsePrecedence(parser, PREC_AND);
 
-	patchJump(endJump);
+	patchJump(parser, endJump);
 }
 
-static void binary(bool)
+static void binary(Parser& parser, bool)
 {
 	TokenType operatorType = parser.previous.type;
 	ParseRule* rule = getRule(operatorType);
-	parsePrecedence((Precedence)(rule->precedence + 1));
+	parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
 	switch (operatorType)
 	{
-	case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-	case TOKEN_EQUAL_EQUAL:	  emitByte(OP_EQUAL); break;
-	case TOKEN_GREATER:		  emitByte(OP_GREATER); break;
-	case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-	case TOKEN_LESS:		  emitByte(OP_LESS); break;
-	case TOKEN_LESS_EQUAL:	  emitBytes(OP_GREATER, OP_NOT); break;
-	case TOKEN_PLUS:	emitByte(OP_ADD); break;
-	case TOKEN_MINUS:	emitByte(OP_SUBTRACT); break;
-	case TOKEN_STAR:	emitByte(OP_MULTIPLY); break;
-	case TOKEN_SLASH:	emitByte(OP_DIVIDE); break;
+	case TOKEN_BANG_EQUAL:    emitOperator(parser, OP_NOT_EQUAL); break;
+	case TOKEN_EQUAL_EQUAL:	  emitOperator(parser, OP_EQUAL); break;
+	case TOKEN_GREATER:		  emitOperator(parser, OP_GREATER); break;
+	case TOKEN_GREATER_EQUAL: emitOperator(parser, OP_GREATER_EQUAL); break;
+	case TOKEN_LESS:		  emitOperator(parser, OP_LESS); break;
+	case TOKEN_LESS_EQUAL:	  emitOperator(parser, OP_LESS_EQUAL); break;
+	case TOKEN_PLUS:	emitOperator(parser, OP_ADD); break;
+	case TOKEN_MINUS:	emitOperator(parser, OP_SUBTRACT); break;
+	case TOKEN_STAR:	emitOperator(parser, OP_MULTIPLY); break;
+	case TOKEN_SLASH:	emitOperator(parser, OP_DIVIDE); break;
 	default: return; // unreachable
 	}
 }
 
-static void call(bool)
+static void call(Parser& parser, bool)
+{
+	uint8_t argCount = argumentList(parser);
+	parser.compiler->lastCall = currentChunk(parser).count();
+	emitBytes(parser, OP_CALL, argCount);
+}
+
+static void emitPropertyCache(Parser& parser)
 {
-	uint8_t argCount = argumentList();
-	emitBytes(OP_CALL, argCount);
+	const size_t cache = currentChunk(parser).addPropertyCache();
+	if (cache > UINT16_MAX)
+	{
+		error(parser, "Too many property accesses in one chunk.");
+	}
+	emitShort(parser, static_cast<uint16_t>(cache));
 }
 
-static void dot(bool canAssign)
+static void dot(Parser& parser, bool canAssign)
 {
-	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifierConstant(&parser.previous);
+	consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+	uint8_t name = identifierConstant(parser, &parser.previous);
 
-	if (canAssign && match(TOKEN_EQUAL))
+	if (canAssign && match(parser, TOKEN_EQUAL))
 	{
-		expression();
-		emitBytes(OP_SET_PROPERTY, name);
+		expression(parser);
+		emitBytes(parser, OP_SET_PROPERTY, name);
 	}
 	else
 	{
-		emitBytes(OP_GET_PROPERTY, name);
+		emitBytes(parser, OP_GET_PROPERTY, name);
 	}
+	emitPropertyCache(parser);
 }
 
-static void literal(bool) {
+static void literal(Parser& parser, bool) {
 	switch (parser.previous.type) {
-	case TOKEN_FALSE: emitByte(OP_FALSE); break;
-	case TOKEN_NIL: emitByte(OP_NIL); break;
-	case TOKEN_TRUE: emitByte(OP_TRUE); break;
+	case TOKEN_FALSE: emitLiteral(parser, BOOL_VAL(false)); break;
+	case TOKEN_NIL: emitLiteral(parser, NIL_VAL); break;
+	case TOKEN_TRUE: emitLiteral(parser, BOOL_VAL(true)); break;
 	default: return; // unreachable
 	}
 }
 
-static void expression()
+static void expression(Parser& parser)
 {
-	parsePrecedence(PREC_ASSIGNMENT);
+	parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block()
+static void block(Parser& parser)
 {
-	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
 	{
-		declaration();
+		declaration(parser);
 	}
 
-	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static void function(Parser& parser, FunctionType type)
 {
 	Compiler compiler;
-	initCompiler(&compiler, type);
-	beginScope();
+	initCompiler(parser, &compiler, type);
+	beginScope(parser);
 
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after closure name.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after closure name.");
 
-	if (!check(TOKEN_RIGHT_PAREN))
+	if (!check(parser, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
-			current->function->arity++;
-			if (current->function->arity > 255)
+			parser.compiler->function->arity++;
+			if (parser.compiler->function->arity > 255)
 			{
-				errorAtCurrent("Can't have more than 255 parameters.");
+				errorAtCurrent(parser, "Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parseVariable("Expect parameter name.");
-			defineVariable(constant);
-		} while (match(TOKEN_COMMA));
+			uint8_t constant = parseVariable(parser, "Expect parameter name.");
+			defineVariable(parser, constant);
+		} while (match(parser, TOKEN_COMMA));
 	}
 
 
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before closure body");
-	block();
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before closure body");
+	block(parser);
 
-	ObjFunction* function = endCompiler();
-	emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+	ObjFunction* function = endCompiler(parser);
+	emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
 	for (int i = 0; i < function->upvalueCount; i++)
 	{
-		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emitByte(compiler.upvalues[i].index);
+		emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+		emitByte(parser, compiler.upvalues[i].index);
 	}
 
 }
 
-static void classDeclaration()
+static void classDeclaration(Parser& parser)
 {
-	consume(TOKEN_IDENTIFIER, "Expect class name.");
-	uint8_t	nameConstant = identifierConstant(&parser.previous);
-	declareVariable();
+	consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+	uint8_t	nameConstant = identifierConstant(parser, &parser.previous);
+	declareVariable(parser);
+	uint16_t global = parser.compiler->scopeDepth > 0 ? 0 : identifierGlobal(parser, &parser.previous);
 
-	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	emitBytes(parser, OP_CLASS, nameConstant);
+	defineVariable(parser, global);
 
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-	consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
 }
 
-static void funDeclaration()
+static void funDeclaration(Parser& parser)
 {
-	uint8_t global = parseVariable("Expect closure name.");
-	markInitialized();
-	function(TYPE_FUNCTION);
-	defineVariable(global);
+	uint16_t global = parseVariable(parser, "Expect closure name.");
+	markInitialized(parser);
+	function(parser, TYPE_FUNCTION);
+	defineVariable(parser, global);
 }
 
-static void varDeclaration()
+static void varDeclaration(Parser& parser)
 {
-	uint8_t global = parseVariable("Expect variable name.");
+	uint16_t global = parseVariable(parser, "Expect variable name.");
 
-	if (match(TOKEN_EQUAL))
+	if (match(parser, TOKEN_EQUAL))
 	{
-		expression();
+		expression(parser);
 	}
 	else
 	{
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 	}
-	consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
-	defineVariable(global);
+	defineVariable(parser, global);
 }
 
-static void expressionStatement()
+static void expressionStatement(Parser& parser)
 {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-	emitByte(OP_POP);
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+	emitByte(parser, OP_POP);
 }
 
-static void forStatement()
+static void forStatement(Parser& parser)
 {
-	beginScope();
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-	if (match(TOKEN_SEMICOLON))
+	beginScope(parser);
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	if (match(parser, TOKEN_SEMICOLON))
 	{
 		// No initializer
 	}
-	else if (match(TOKEN_VAR))
+	else if (match(parser, TOKEN_VAR))
 	{
-		varDeclaration();
+		varDeclaration(parser);
 	}
 	else
 	{
-		expressionStatement();
+		expressionStatement(parser);
 	}
 
 
 
-	size_t loopStart = currentChunk().count();
+	size_t loopStart = currentChunk(parser).count();
+	markJumpTarget(parser);
 	size_t exitJump = 0;
-	if (!match(TOKEN_SEMICOLON))
+	if (!match(parser, TOKEN_SEMICOLON))
 	{
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition");
 
-		exitJump = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP);
+		exitJump = emitConditionJump(parser);
 	}
 
-	if (!match(TOKEN_RIGHT_PAREN))
+	if (!match(parser, TOKEN_RIGHT_PAREN))
 	{
-		size_t bodyJump = emitJump(OP_JUMP);
-		size_t incrementStart = currentChunk().count();
-		expression();
-		emitByte(OP_POP);
-		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-		emitLoop(loopStart);
+		size_t bodyJump = emitJump(parser, OP_JUMP);
+		size_t incrementStart = currentChunk(parser).count();
+		markJumpTarget(parser);
+		expression(parser);
+		emitByte(parser, OP_POP);
+		consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+		emitLoop(parser, loopStart);
 		loopStart = incrementStart;
-		patchJump(bodyJump);
+		patchJump(parser, bodyJump);
 	}
 
-	statement();
-	emitLoop(loopStart);
+	statement(parser);
+	emitLoop(parser, loopStart);
 
 	if (exitJump != 0) // exitJump can never be zero, unless the loop condition doesn't exist
 	{
-		patchJump(exitJump);
-		emitByte(OP_POP);
+		patchJump(parser, exitJump);
 	}
 
-	endScope();
+	endScope(parser);
 }
 
-static void ifStatement()
+static void ifStatement(Parser& parser)
 {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	size_t thenJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
+	size_t thenJump = emitConditionJump(parser);
+	statement(parser);
 
-	size_t elseJump = emitJump(OP_JUMP);
+	size_t elseJump = emitJump(parser, OP_JUMP);
 
-	patchJump(thenJump);
-	emitByte(OP_POP);
+	patchJump(parser, thenJump);
 
-	if (match(TOKEN_ELSE)) statement();
-	patchJump(elseJump);
+	if (match(parser, TOKEN_ELSE)) statement(parser);
+	patchJump(parser, elseJump);
 }
 
-static void printStatement()
+static void printStatement(Parser& parser)
 {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-	emitByte(OP_PRINT);
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+	emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement()
+static void returnStatement(Parser& parser)
 {
-	if (current->type == TYPE_SCRIPT)
+	if (parser.compiler->type == TYPE_SCRIPT)
 	{
-		error("Can't return from top-level code.");
+		error(parser, "Can't return from top-level code.");
 	}
 
-	if (match(TOKEN_SEMICOLON))
+	if (match(parser, TOKEN_SEMICOLON))
 	{
-		emitReturn();
+		emitReturn(parser);
 	}
 	else
 	{
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-		emitByte(OP_RETURN);
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+		// the call is in tail position when nothing runs between it and the return,
+		// unless a jump lands after it (like in "return a and f();")
+		Chunk& chunk = currentChunk(parser);
+		if (parser.compiler->lastCall == chunk.count() - 2 && parser.compiler->lastCall >= parser.compiler->jumpTarget)
+		{
+			chunk.code[parser.compiler->lastCall] = OP_TAIL_CALL;
+		}
+		emitByte(parser, OP_RETURN);
 	}
 }
 
-static void whileStatement()
+static void whileStatement(Parser& parser)
 {
-	size_t loopStart = currentChunk().code.size();
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	size_t loopStart = currentChunk(parser).code.size();
+	markJumpTarget(parser);
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	size_t exitJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
-	emitLoop(loopStart);
+	size_t exitJump = emitConditionJump(parser);
+	statement(parser);
+	emitLoop(parser, loopStart);
 
-	patchJump(exitJump);
-	emitByte(OP_POP);
+	patchJump(parser, exitJump);
 }
 
-static void synchronize()
+static void synchronize(Parser& parser)
 {
 	parser.panicMode = false;
 
@@ -730,144 +1012,154 @@ static void synchronize()
 			; // do nothing
 		}
 
-		advance();
+		advance(parser);
 	}
 
 }
 
-static void declaration()
+static void declaration(Parser& parser)
 {
-	if (match(TOKEN_CLASS))
+	if (match(parser, TOKEN_CLASS))
 	{
-		classDeclaration();
+		classDeclaration(parser);
 	}
-	else if (match(TOKEN_FUN))
+	else if (match(parser, TOKEN_FUN))
 	{
-		funDeclaration();
+		funDeclaration(parser);
 	}
-	else if (match(TOKEN_VAR))
+	else if (match(parser, TOKEN_VAR))
 	{
-		varDeclaration();
+		varDeclaration(parser);
 	}
 	else
 	{
-		statement();
+		statement(parser);
 	}
 
-	if (parser.panicMode) synchronize();
+	if (parser.panicMode) synchronize(parser);
 }
 
-static void statement()
+static void statement(Parser& parser)
 {
-	if (match(TOKEN_PRINT))
+	if (match(parser, TOKEN_PRINT))
 	{
-		printStatement();
+		printStatement(parser);
 	}
-	else if (match(TOKEN_FOR))
+	else if (match(parser, TOKEN_FOR))
 	{
-		forStatement();
+		forStatement(parser);
 	}
-	else if (match(TOKEN_IF))
+	else if (match(parser, TOKEN_IF))
 	{
-		ifStatement();
+		ifStatement(parser);
 	}
-	else if (match(TOKEN_RETURN))
+	else if (match(parser, TOKEN_RETURN))
 	{
-		returnStatement();
+		returnStatement(parser);
 	}
-	else if (match(TOKEN_WHILE))
+	else if (match(parser, TOKEN_WHILE))
 	{
-		whileStatement();
+		whileStatement(parser);
 	}
-	else if (match(TOKEN_LEFT_BRACE))
+	else if (match(parser, TOKEN_LEFT_BRACE))
 	{
-		beginScope();
-		block();
-		endScope();
+		beginScope(parser);
+		block(parser);
+		endScope(parser);
 	}
 	else
 	{
-		expressionStatement();
+		expressionStatement(parser);
 	}
 }
 
-static void grouping(bool)
+static void grouping(Parser& parser, bool)
 {
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool)
+static void number(Parser& parser, bool)
 {
 	double value = strtod(parser.previous.start, nullptr);
-	emitConstant(NUMBER_VAL(value));
+	emitLiteral(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool)
+static void or_(Parser& parser, bool)
 {
-	size_t elseJump = emitJump(OP_JUMP_IF_FALSE);
-	size_t endJump = emitJump(OP_JUMP);
+	size_t elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	size_t endJump = emitJump(parser, OP_JUMP);
 
-	patchJump(elseJump);
-	emitByte(OP_POP);
+	patchJump(parser, elseJump);
+	emitByte(parser, OP_POP);
 
-	parsePrecedence(PREC_OR);
-	patchJump(endJump);
+	parsePrecedence(parser, PREC_OR);
+	patchJump(parser, endJump);
 }
 
-static void string(bool) {
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser& parser, bool) {
+	emitLiteral(parser, OBJ_VAL(copyString(parser.vm, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser& parser, Token name, bool canAssign)
 {
 	uint8_t getOp, setOp;
-	int arg = resolveLocal(current, &name);
+	int arg = resolveLocal(parser, parser.compiler, &name);
 	if (arg != -1)
 	{
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
 	}
-	else if ((arg = resolveUpvalue(current, &name)) != -1)
+	else if ((arg = resolveUpvalue(parser, parser.compiler, &name)) != -1)
 	{
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	}
 	else
 	{
-		arg = identifierConstant(&name);
+		arg = identifierGlobal(parser, &name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
-	if (canAssign && match(TOKEN_EQUAL))
+	if (canAssign && match(parser, TOKEN_EQUAL))
 	{
-		expression();
-		emitBytes(setOp, static_cast<uint8_t>(arg));
+		expression(parser);
+		emitByte(parser, setOp);
 	}
 	else
 	{
-		emitBytes(getOp, static_cast<uint8_t>(arg));
+		emitByte(parser, getOp);
+	}
+
+	// globals are addressed by a 16 bit slot instead of a one byte operand
+	if (getOp == OP_GET_GLOBAL)
+	{
+		emitShort(parser, static_cast<uint16_t>(arg));
+	}
+	else
+	{
+		emitByte(parser, static_cast<uint8_t>(arg));
 	}
 }
 
-static void variable(bool canAssign)
+static void variable(Parser& parser, bool canAssign)
 {
-	namedVariable(parser.previous, canAssign);
+	namedVariable(parser, parser.previous, canAssign);
 }
 
-static void unary(bool)
+static void unary(Parser& parser, bool)
 {
 	TokenType operatorType = parser.previous.type;
 
 	// compile the operand
-	parsePrecedence(PREC_UNARY);
+	parsePrecedence(parser, PREC_UNARY);
 
 	switch (operatorType)
 	{
-	case TOKEN_BANG: emitByte(OP_NOT); break;
-	case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+	case TOKEN_BANG: emitOperator(parser, OP_NOT); break;
+	case TOKEN_MINUS: emitOperator(parser, OP_NEGATE); break;
 	default: return;
 	}
 }
@@ -917,29 +1209,29 @@ ParseRule rules[] = {
 	/*[TOKEN_EOF]          */ {nullptr,  nullptr, PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser& parser, Precedence precedence)
 {
-	advance();
+	advance(parser);
 	const ParseFn prefixRule = getRule(parser.previous.type)->prefix;
 	if (prefixRule == nullptr)
 	{
-		error("expect expression.");
+		error(parser, "expect expression.");
 		return;
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
-	prefixRule(canAssign);
+	prefixRule(parser, canAssign);
 
 	while (precedence <= getRule(parser.current.type)->precedence)
 	{
-		advance();
+		advance(parser);
 		const ParseFn infixRule = getRule(parser.previous.type)->inFix; // nts: merge these two lines
-		infixRule(canAssign);
+		infixRule(parser, canAssign);
 	}
 
-	if (canAssign && match(TOKEN_EQUAL))
+	if (canAssign && match(parser, TOKEN_EQUAL))
 	{
-		error("Invalid assignment target.");
+		error(parser, "Invalid assignment target.");
 	}
 
 }
@@ -949,32 +1241,40 @@ static ParseRule* getRule(const TokenType type)
 	return &rules[type];
 }
 
-ObjFunction* compile(const std::string& source)
+ObjFunction* compile(VM& vm, const std::string& source)
 {
-	initScanner(source);
-	Compiler compiler;
-	initCompiler(&compiler, TYPE_SCRIPT);
-
+	Parser parser(vm);
+	initScanner(parser.scanner, source);
+	parser.compiler = nullptr;
 	parser.hadError = false;
 	parser.panicMode = false;
+	vm.parser = &parser;
+
+	Compiler compiler;
+	initCompiler(parser, &compiler, TYPE_SCRIPT);
 
-	advance();
+	advance(parser);
 
-	while (!match(TOKEN_EOF))
+	while (!match(parser, TOKEN_EOF))
 	{
-		declaration();
+		declaration(parser);
 	}
 
-	ObjFunction* function = endCompiler();
+	ObjFunction* function = endCompiler(parser);
+	vm.parser = nullptr;
 	return parser.hadError ? nullptr : function;
 }
 
-void markCompilerRoots()
+void markCompilerRoots(VM& vm)
 {
-	Compiler* compiler = current;
+	if (vm.parser == nullptr) return;
+
+	Compiler* compiler = vm.parser->compiler;
 	while (compiler != nullptr)
 	{
-		markObject(reinterpret_cast<Obj*>(compiler->function));
+		markObject(vm, reinterpret_cast<Obj*>(compiler->function));
+		// functions are written to without barriers while compiling, so old ones are rescanned every collection
+		rememberObject(vm, reinterpret_cast<Obj*>(compiler->function));
 		compiler = compiler->enclosing;
 	}
 }
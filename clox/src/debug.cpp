@@ -8,6 +8,7 @@
 #include <iostream>
 
 #include "util.h"
+#include "vm.h"
 
 // nts: turn these into static functions taking in a "this" pointer?
 size_t Chunk::simpleInstruction(const std::string& name, const size_t offset)
@@ -31,6 +32,23 @@ size_t Chunk::jumpInstruction(const char* name, int sign, size_t offset) const
 	return offset + 3;
 }
 
+size_t Chunk::propertyInstruction(const char* name, size_t offset) const
+{
+	const uint8_t constant = code[offset + 1];
+	const uint16_t cache = static_cast<uint16_t>(code[offset + 2] << 8 | code[offset + 3]);
+	printf("%-16s %4d '", name, constant);
+	printValue(constants[constant]);
+	printf("' cache %d\n", cache);
+	return offset + 4;
+}
+
+size_t Chunk::globalInstruction(const VM& vm, const char* name, size_t offset) const
+{
+	const uint16_t slot = static_cast<uint16_t>(code[offset + 1] << 8 | code[offset + 2]);
+	printf("%-16s %4d '%s'\n", name, slot, vm.globalNames[slot]->chars);
+	return offset + 3;
+}
+
 size_t Chunk::constantInstruction(const char* name, size_t offset) const
 {
 	const uint8_t constant = code[offset + 1];
@@ -42,20 +60,20 @@ size_t Chunk::constantInstruction(const char* name, size_t offset) const
 }
 
 
-size_t Chunk::disassembleInstruction(size_t offset) const
+size_t Chunk::disassembleInstruction(const VM& vm, size_t offset) const
 {
 	// nts: printf vs std::cout?
 	grey();
 	printf("%04llu ", offset);
 
 	grey();
-	if (offset > 0 && lines[offset] == lines[offset - 1])
+	if (offset > 0 && getLine(offset) == getLine(offset - 1))
 	{
 		printf("   | ");
 	}
 	else
 	{
-		printf("%4llu ", lines[offset]);
+		printf("%4llu ", getLine(offset));
 	}
 	white();
 
@@ -74,19 +92,19 @@ size_t Chunk::disassembleInstruction(size_t offset) const
 	case OP_SET_LOCAL:
 		return byteInstruction("OP_SET_LOCAL", offset);
 	case OP_GET_GLOBAL:
-		return constantInstruction("OP_GET_GLOBAL", offset);
+		return globalInstruction(vm, "OP_GET_GLOBAL", offset);
 	case OP_DEFINE_GLOBAL:
-		return constantInstruction("OP_DEFINE_GLOBAL", offset);
+		return globalInstruction(vm, "OP_DEFINE_GLOBAL", offset);
 	case OP_SET_GLOBAL:
-		return constantInstruction("OP_SET_GLOBAL", offset);
+		return globalInstruction(vm, "OP_SET_GLOBAL", offset);
 	case OP_GET_UPVALUE:
 		return byteInstruction("OP_GET_UPVALUE", offset);
 	case OP_SET_UPVALUE:
 		return byteInstruction("OP_SET_UPVALUE", offset);
 	case OP_GET_PROPERTY:
-		return constantInstruction("OP_GET_PROPERTY", offset);
+		return propertyInstruction("OP_GET_PROPERTY", offset);
 	case OP_SET_PROPERTY:
-		return constantInstruction("OP_SET_PROPERTY", offset);
+		return propertyInstruction("OP_SET_PROPERTY", offset);
 		SIMPLE_INSTRUCTION(OP_EQUAL);
 		SIMPLE_INSTRUCTION(OP_GREATER);
 		SIMPLE_INSTRUCTION(OP_LESS);
@@ -130,6 +148,49 @@ size_t Chunk::disassembleInstruction(size_t offset) const
 	SIMPLE_INSTRUCTION(OP_RETURN);
 	case OP_CLASS:
 		return constantInstruction("OP_CLASS", offset);
+	SIMPLE_INSTRUCTION(OP_NOT_EQUAL);
+	SIMPLE_INSTRUCTION(OP_GREATER_EQUAL);
+	SIMPLE_INSTRUCTION(OP_LESS_EQUAL);
+	case OP_POP_JUMP_IF_FALSE:
+		return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, offset);
+	case OP_ADD_CONSTANT:
+		return constantInstruction("OP_ADD_CONSTANT", offset);
+	case OP_SUBTRACT_CONSTANT:
+		return constantInstruction("OP_SUBTRACT_CONSTANT", offset);
+	case OP_LESS_CONSTANT:
+		return constantInstruction("OP_LESS_CONSTANT", offset);
+	case OP_SET_LOCAL_POP:
+		return byteInstruction("OP_SET_LOCAL_POP", offset);
+	case OP_SET_GLOBAL_POP:
+		return globalInstruction(vm, "OP_SET_GLOBAL_POP", offset);
+	case OP_JUMP_UNLESS_EQUAL:
+		return jumpInstruction("OP_JUMP_UNLESS_EQUAL", 1, offset);
+	case OP_JUMP_UNLESS_NOT_EQUAL:
+		return jumpInstruction("OP_JUMP_UNLESS_NOT_EQUAL", 1, offset);
+	case OP_JUMP_UNLESS_GREATER:
+		return jumpInstruction("OP_JUMP_UNLESS_GREATER", 1, offset);
+	case OP_JUMP_UNLESS_LESS:
+		return jumpInstruction("OP_JUMP_UNLESS_LESS", 1, offset);
+	case OP_JUMP_UNLESS_GREATER_EQUAL:
+		return jumpInstruction("OP_JUMP_UNLESS_GREATER_EQUAL", 1, offset);
+	case OP_JUMP_UNLESS_LESS_EQUAL:
+		return jumpInstruction("OP_JUMP_UNLESS_LESS_EQUAL", 1, offset);
+	case OP_JUMP_UNLESS_LESS_CONSTANT:
+	{
+		const uint8_t constant = code[offset + 1];
+		const uint16_t jump = static_cast<uint16_t>(code[offset + 2] << 8 | code[offset + 3]);
+		printf("%-16s %4d '", "OP_JUMP_UNLESS_LESS_CONSTANT", constant);
+		printValue(constants[constant]);
+		printf("' -> %llu\n", offset + 4 + jump);
+		return offset + 4;
+	}
+	SIMPLE_INSTRUCTION(OP_ADD_NUM);
+	SIMPLE_INSTRUCTION(OP_EQUAL_NUM);
+	SIMPLE_INSTRUCTION(OP_NOT_EQUAL_NUM);
+	case OP_GET_PROPERTY_MONO:
+		return propertyInstruction("OP_GET_PROPERTY_MONO", offset);
+	case OP_TAIL_CALL:
+		return byteInstruction("OP_TAIL_CALL", offset);
 	default:
 		std::cout << "Unknown opcode " << static_cast<uint8_t>(instruction) << "\n";
 		return offset + 1;
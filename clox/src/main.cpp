@@ -5,6 +5,7 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 #include <stdlib.h>
@@ -85,25 +86,25 @@ static int sourceIncompleteness(const std::string& source)
 
 }
 
-static void RunFile(const char* path)
+// returns the exit code, main still has to print the stats when the script fails
+static int RunFile(VM& vm, const char* path)
 {
 	if (std::ifstream inputStream(path); inputStream.is_open())
 	{
 		const std::string source((std::istreambuf_iterator(inputStream)), std::istreambuf_iterator<char>());
 
-		const InterpretResult result = interpret(source);
+		const InterpretResult result = interpret(vm, source);
 
-		if (result == INTERPRET_COMPILE_ERROR) exit(65);
-		if (result == INTERPRET_RUNTIME_ERROR) exit(70);
-	}
-	else
-	{
-		std::cerr << "Couldn't open file \"" << path << "\".\n";
-		exit(74);
+		if (result == INTERPRET_COMPILE_ERROR) return 65;
+		if (result == INTERPRET_RUNTIME_ERROR) return 70;
+		return 0;
 	}
+
+	std::cerr << "Couldn't open file \"" << path << "\".\n";
+	return 74;
 }
 
-static void repl(const bool qualityOfLife)
+static void repl(VM& vm, const bool qualityOfLife)
 {
 	std::string source;
 	std::string line;
@@ -145,7 +146,7 @@ static void repl(const bool qualityOfLife)
 		lines = 1;
 
 		// interpret
-		interpret(source);
+		interpret(vm, source);
 
 		// for unit testing
 		//if (!qualityOfLife)
@@ -161,29 +162,72 @@ static void repl(const bool qualityOfLife)
 
 int main(const int argc, const char* argv[])
 {
-	initVM();
-	if (argc == 1)
+	VM vm;
+	initVM(vm);
+
+	// leading flags toggle the debug output at runtime, the remaining argument is the path (or "test")
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+	{
+		if (strcmp(argv[arg], "--trace") == 0)
+		{
+			vm.traceExecution = true;
+		}
+		else if (strcmp(argv[arg], "--print-code") == 0)
+		{
+			vm.printCode = true;
+		}
+		else if (strcmp(argv[arg], "--gc-pause") == 0 && arg + 1 < argc)
+		{
+			vm.gcPauseBudget = atoi(argv[++arg]);
+		}
+		else if (strcmp(argv[arg], "--gc-stats") == 0)
+		{
+			vm.gcStats = true;
+		}
+		else if (strcmp(argv[arg], "--max-frames") == 0 && arg + 1 < argc)
+		{
+			const int depth = atoi(argv[++arg]);
+			vm.maxFrames = depth < 1 ? 1 : static_cast<size_t>(depth);
+			// call() only checks the limit once the frame array is full
+			if (vm.frameCapacity > vm.maxFrames) vm.frameCapacity = vm.maxFrames;
+		}
+		else if (strcmp(argv[arg], "--op-stats") == 0)
+		{
+			vm.opStats = true;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option '%s'.\n", argv[arg]);
+			exit(64);
+		}
+	}
+
+	int status = 0;
+	if (arg == argc)
 	{
-		repl(true);
+		repl(vm, true);
 	}
-	else if (argc == 2)
+	else if (arg == argc - 1)
 	{
-		if (strcmp(argv[1], "test") == 0)
+		if (strcmp(argv[arg], "test") == 0)
 		{
-			repl(false);
+			repl(vm, false);
 		}
 		else
 		{
-			RunFile(argv[0]);
+			status = RunFile(vm, argv[arg]);
 		}
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
+		fprintf(stderr, "Usage: clox [--trace] [--print-code] [--gc-pause microseconds] [--gc-stats] [--op-stats] [--max-frames depth] [path]\n");
 		exit(64);
 	}
 
-	freeVM();
+	if (vm.gcStats) printGcStats(vm);
+	if (vm.opStats) printOpStats(vm);
+	freeVM(vm);
 
-	return 0;
+	return status;
 }
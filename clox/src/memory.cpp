@@ -1,5 +1,7 @@
 #include "memory.h"
 
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <Windows.h>
 
@@ -14,44 +16,156 @@
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2;
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_NURSERY_SIZE (256 * 1024) // bytes allocated between young generation collections
+#define GC_STEP_SIZE (64 * 1024) // bytes allocated between incremental steps of a full collection
+#define GC_SLICE_CHECK 64 // objects traced or swept between looking at the clock
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+static void beginCollection(VM& vm);
+static void collectionStep(VM& vm, bool bounded);
+
+static bool isPooled(size_t size)
 {
-	vm.bytesAllocated += newSize - oldSize;
+	return size <= POOL_MAX_SIZE;
+}
+
+// the number of bytes an allocation of this size really takes up
+static size_t footprint(size_t size)
+{
+	if (!isPooled(size)) return size;
+	return (size + POOL_GRANULARITY - 1) / POOL_GRANULARITY * POOL_GRANULARITY;
+}
+
+static void* acquire(VM& vm, size_t size)
+{
+	if (!isPooled(size))
+	{
+		void* result = malloc(size);
+		if (result == nullptr) { exit(1); }
+		return result;
+	}
+
+	const size_t sizeClass = (size - 1) / POOL_GRANULARITY;
+	if (PoolSlot* slot = vm.pool.freeLists[sizeClass]; slot != nullptr)
+	{
+		vm.pool.freeLists[sizeClass] = slot->next;
+		return slot;
+	}
+
+	const size_t slotSize = (sizeClass + 1) * POOL_GRANULARITY;
+	if (vm.pool.pageTop == nullptr || vm.pool.pageTop + slotSize > vm.pool.pageEnd)
+	{
+		// whatever is left of the old page is abandoned
+		char* page = static_cast<char*>(malloc(POOL_PAGE_SIZE));
+		if (page == nullptr) { exit(1); }
+		*reinterpret_cast<char**>(page) = vm.pool.pages;
+		vm.pool.pages = page;
+		vm.pool.pageTop = page + POOL_GRANULARITY;
+		vm.pool.pageEnd = page + POOL_PAGE_SIZE;
+	}
+
+	void* result = vm.pool.pageTop;
+	vm.pool.pageTop += slotSize;
+	return result;
+}
+
+static void release(VM& vm, void* pointer, size_t size)
+{
+	if (pointer == nullptr) return;
+	if (!isPooled(size))
+	{
+		free(pointer);
+		return;
+	}
+
+	// freed slots go straight back on the free list of their class, so sweeping refills the pool
+	PoolSlot* slot = static_cast<PoolSlot*>(pointer);
+	const size_t sizeClass = (size - 1) / POOL_GRANULARITY;
+	slot->next = vm.pool.freeLists[sizeClass];
+	vm.pool.freeLists[sizeClass] = slot;
+}
+
+void* reallocate(VM& vm, void* pointer, size_t oldSize, size_t newSize)
+{
+	vm.bytesAllocated += footprint(newSize) - footprint(oldSize);
 	if (newSize > oldSize)
 	{
 #ifdef DEBUG_STRESS_GC
-		collectGarbage();
+		if (vm.gcPhase != GC_IDLE)
+		{
+			collectionStep(vm, true);
+		}
+		else if (vm.bytesAllocated > vm.nextGC)
+		{
+			beginCollection(vm);
+		}
+		else
+		{
+			collectYoungGarbage(vm);
+		}
 #else
-		if (vm.bytesAllocated > vm.nextGC)
+		if (vm.gcPhase != GC_IDLE)
 		{
-			collectGarbage();
+			// don't let the heap run away from a collection that can't keep up
+			if (vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR)
+			{
+				collectGarbage(vm);
+			}
+			else if (vm.bytesAllocated > vm.nextGCStep)
+			{
+				collectionStep(vm, true);
+			}
+		}
+		else if (vm.bytesAllocated > vm.nextGC)
+		{
+			beginCollection(vm);
+		}
+		else if (vm.bytesAllocated > vm.nextMinorGC)
+		{
+			collectYoungGarbage(vm);
 		}
 #endif
 	}
 
 	if (newSize == 0)
 	{
-		free(pointer);
+		release(vm, pointer, oldSize);
 		return nullptr;
 	}
 
-	void* result = realloc(pointer, newSize);
-	if (result == nullptr) { exit(1); }
+	if (pointer == nullptr) return acquire(vm, newSize);
+
+	// still fits in the same size class
+	if (isPooled(oldSize) && isPooled(newSize) && footprint(oldSize) == footprint(newSize)) return pointer;
+
+	if (!isPooled(oldSize) && !isPooled(newSize))
+	{
+		void* result = realloc(pointer, newSize);
+		if (result == nullptr) { exit(1); }
+		return result;
+	}
+
+	void* result = acquire(vm, newSize);
+	memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+	release(vm, pointer, oldSize);
 	return result;
 }
 
-void markObject(Obj* object)
+void countExternal(VM& vm, const size_t oldSize, const size_t newSize)
+{
+	vm.bytesAllocated += newSize - oldSize;
+}
+
+void markObject(VM& vm, Obj* object)
 {
 	if (object == nullptr) return;
-	if (object->isMarked) return;
+	if (isMarked(vm, object)) return;
 #ifdef DEBUG_LOG_GC
 	printf("%p mark ", static_cast<void*>(object));
 	printValue(OBJ_VAL(object));
 	printf("\n");
 #endif
-	object->isMarked = true;
+	object->mark = vm.markValue;
 
 	if (vm.grayCapacity < vm.grayCount + 1)
 	{
@@ -63,20 +177,36 @@ void markObject(Obj* object)
 	vm.grayStack[vm.grayCount++] = object;
 }
 
-void markValue(Value value)
+void rememberObject(VM& vm, Obj* object)
+{
+	// young (white) objects are traced anyway
+	if (!isMarked(vm, object) || object->isRemembered) return;
+	object->isRemembered = true;
+
+	if (vm.rememberedCapacity < vm.rememberedCount + 1)
+	{
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		vm.rememberedSet = static_cast<Obj**>(realloc(vm.rememberedSet, sizeof(Obj*) * vm.rememberedCapacity));
+		if (vm.rememberedSet == nullptr) exit(1);
+	}
+
+	vm.rememberedSet[vm.rememberedCount++] = object;
+}
+
+void markValue(VM& vm, Value value)
 {
-	if (IS_OBJ(value)) markObject(AS_OBJ(value));
+	if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(Blob<Value>& array)
+static void markArray(VM& vm, Blob<Value>& array)
 {
 	for (size_t i = 0; i < array.size(); i++)
 	{
-		markValue(array[i]);
+		markValue(vm, array[i]);
 	}
 }
 
-static void blackenObject(Obj* object)
+static void blackenObject(VM& vm, Obj* object)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p blacken ", reinterpret_cast<void*>(object));
@@ -89,36 +219,68 @@ static void blackenObject(Obj* object)
 	case OBJ_CLASS:
 	{
 		ObjClass* klass = reinterpret_cast<ObjClass*>(object);
-		markObject(reinterpret_cast<Obj*>(klass->name));
+		markObject(vm, reinterpret_cast<Obj*>(klass->name));
+		markObject(vm, reinterpret_cast<Obj*>(klass->shape));
 		break;
 	}
 	case OBJ_CLOSURE:
 	{
 
 		ObjClosure* closure = reinterpret_cast<ObjClosure*>(object);
-		markObject(reinterpret_cast<Obj*>(closure->function));
+		markObject(vm, reinterpret_cast<Obj*>(closure->function));
 		for (int i = 0; i < closure->upvalueCount; i++)
 		{
-			markObject(reinterpret_cast<Obj*>(closure->upvalues[i]));
+			markObject(vm, reinterpret_cast<Obj*>(closure->upvalues[i]));
 		}
 		break;
 	}
 	case OBJ_FUNCTION:
 	{
 		ObjFunction* function = reinterpret_cast<ObjFunction*>(object);
-		markObject(reinterpret_cast<Obj*>(function->name));
-		markArray(function->chunk.constants);
+		markObject(vm, reinterpret_cast<Obj*>(function->name));
+		markObject(vm, reinterpret_cast<Obj*>(function->closure));
+		markArray(vm, function->chunk.constants);
+		// cached shapes are kept alive, a freed shape's address could be reused by a different layout
+		for (size_t i = 0; i < function->chunk.propertyCaches.size(); i++)
+		{
+			const PropertyCache& cache = function->chunk.propertyCaches[i];
+			for (int j = 0; j < cache.count; j++)
+			{
+				markObject(vm, reinterpret_cast<Obj*>(cache.entries[j].shape));
+				markObject(vm, reinterpret_cast<Obj*>(cache.entries[j].newShape));
+			}
+		}
 		break;
 	}
 	case OBJ_INSTANCE:
 	{
 		ObjInstance* instance = reinterpret_cast<ObjInstance*>(object);
-		markObject((Obj*)instance->klass);
-		instance->fields.mark();
+		markObject(vm, (Obj*)instance->klass);
+		markObject(vm, reinterpret_cast<Obj*>(instance->shape));
+		for (int i = 0; i < instance->shape->fieldCount; i++)
+		{
+			markValue(vm, instance->fields[i]);
+		}
+		break;
+	}
+	case OBJ_ROPE:
+	{
+		ObjRope* rope = reinterpret_cast<ObjRope*>(object);
+		markValue(vm, rope->left);
+		markValue(vm, rope->right);
+		markObject(vm, reinterpret_cast<Obj*>(rope->flat));
+		break;
+	}
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = reinterpret_cast<ObjShape*>(object);
+		markObject(vm, reinterpret_cast<Obj*>(shape->parent));
+		markObject(vm, reinterpret_cast<Obj*>(shape->name));
+		shape->transitions.mark(vm);
 		break;
 	}
 	case OBJ_UPVALUE:
-		markValue(reinterpret_cast<ObjUpvalue*>(object)->closed);
+		markValue(vm, reinterpret_cast<ObjUpvalue*>(object)->closed);
 		break;
 	case OBJ_NATIVE:
 	case OBJ_STRING:
@@ -126,7 +288,7 @@ static void blackenObject(Obj* object)
 	}
 }
 
-static void freeObject(Obj* object)
+static void freeObject(VM& vm, Obj* object)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %s: ", (void*)object, ObjTypeNames[object->type]);
@@ -137,14 +299,12 @@ static void freeObject(Obj* object)
 	{
 	case OBJ_CLASS:
 	{
-		FREE(ObjClass, object);
+		FREE(vm, ObjClass, object);
 		break;
 	}
 	case OBJ_CLOSURE:
 	{
-		ObjClosure* closure = reinterpret_cast<ObjClosure*>(object);
-		FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-		FREE(ObjClosure, object);
+		reallocate(vm, object, closureSize(reinterpret_cast<ObjClosure*>(object)->upvalueCount), 0);
 		break;
 	}
 	case OBJ_FUNCTION:
@@ -152,132 +312,318 @@ static void freeObject(Obj* object)
 		// todo: make sure this is correct, especially the name field
 		ObjFunction* function = reinterpret_cast<ObjFunction*>(object);
 		function->chunk.~Chunk();
-		FREE(ObjFunction, object);
+		FREE(vm, ObjFunction, object);
 		break;
 	}
 	case OBJ_INSTANCE:
 	{
 		ObjInstance* instance = reinterpret_cast<ObjInstance*>(object);
-		instance->fields.~Table();
-		FREE(ObjInstance, object);
+		if (instance->fieldCapacity > instance->inlineCapacity)
+		{
+			FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+		}
+		reallocate(vm, object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
+		break;
+	}
+	case OBJ_ROPE:
+	{
+		FREE(vm, ObjRope, object);
+		break;
+	}
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = reinterpret_cast<ObjShape*>(object);
+		shape->transitions.~Table();
+		FREE(vm, ObjShape, object);
 		break;
 	}
 	case OBJ_NATIVE:
 	{
-		FREE(ObjNative, object);
+		FREE(vm, ObjNative, object);
 		break;
 	}
 	case OBJ_STRING:
 	{
-		ObjString* string = reinterpret_cast<ObjString*>(object);
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		reallocate(vm, object, stringSize(reinterpret_cast<ObjString*>(object)->length), 0);
 		break;
 	}
 	case OBJ_UPVALUE:
 	{
-		FREE(ObjUpvalue, object);
+		FREE(vm, ObjUpvalue, object);
 		break;
 	}
 	}
 }
 
-static void markRoots()
+static void markRoots(VM& vm)
 {
 	for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
 	{
-		markValue(*slot);
+		markValue(vm, *slot);
 	}
 
 	for (size_t i = 0; i < vm.frameCount; i++)
 	{
-		markObject(reinterpret_cast<Obj*>(vm.frames[i].closure));
+		markObject(vm, reinterpret_cast<Obj*>(vm.frames[i].closure));
 	}
 
 	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != nullptr; upvalue = upvalue->next)
 	{
-		markObject(reinterpret_cast<Obj*>(upvalue));
+		markObject(vm, reinterpret_cast<Obj*>(upvalue));
 	}
 
-	vm.globals.mark();
+	vm.globals.mark(vm);
+	markArray(vm, vm.globalValues);
 
-	markCompilerRoots();
+	markCompilerRoots(vm);
 }
 
-static void traceReferences()
+static void traceReferences(VM& vm)
 {
 	while (vm.grayCount > 0)
 	{
 		Obj* object = vm.grayStack[--vm.grayCount];
-		blackenObject(object);
+		blackenObject(vm, object);
 	}
 }
 
-static void sweep()
+// rescans the old objects that were written to since they were marked
+static void blackenRemembered(VM& vm)
+{
+	for (int i = 0; i < vm.rememberedCount; i++)
+	{
+		vm.rememberedSet[i]->isRemembered = false;
+		blackenObject(vm, vm.rememberedSet[i]);
+	}
+	vm.rememberedCount = 0;
+}
+
+using GcClock = std::chrono::steady_clock;
+
+static void recordPause(VM& vm, GcClock::time_point start)
+{
+	const double pause = std::chrono::duration<double, std::micro>(GcClock::now() - start).count();
+
+	size_t bucket = 0;
+	for (double limit = 1; bucket < GC_PAUSE_BUCKETS - 1 && pause >= limit; limit *= 10) bucket++;
+	vm.gcPauses[bucket]++;
+
+	if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
+	vm.gcTotalPause += pause;
+}
+
+// collects only the objects allocated since the last collection
+// old objects are still marked, so tracing stops at them, except for the remembered ones which may point to young objects
+void collectYoungGarbage(VM& vm)
 {
-	Obj* previous = nullptr;
+	const GcClock::time_point start = GcClock::now();
+#ifdef DEBUG_LOG_GC
+	grey();
+	printf("-- minor gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif
+
+	markRoots(vm);
+	blackenRemembered(vm);
+	traceReferences(vm);
+	vm.strings.removeWhite(vm);
+
+	// every marked object survives and is promoted, the others are freed
 	Obj* object = vm.objects;
+	vm.objects = nullptr;
 	while (object != nullptr)
 	{
-		if (object->isMarked)
+		Obj* next = object->next;
+		if (isMarked(vm, object))
 		{
-			object->isMarked = false;
-			previous = object;
-			object = object->next;
+			object->next = vm.oldObjects;
+			vm.oldObjects = object;
 		}
 		else
 		{
-			Obj* unreached = object;
-			object = object->next;
-			if (previous != nullptr)
-			{
-				previous->next = object;
-			}
-			else
-			{
-				vm.objects = object;
-			}
-			freeObject(unreached);
+			freeObject(vm, object);
 		}
+		object = next;
 	}
+
+	vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc end\n");
+	if (before != vm.bytesAllocated) white();
+
+	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+		before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextMinorGC);
+	white();
+#endif
+	recordPause(vm, start);
 }
 
-void collectGarbage()
+// starts an incremental full collection
+static void beginCollection(VM& vm)
 {
+	// empty the young generation first, so that every object is marked and flipping the mark value unmarks them all
+	collectYoungGarbage(vm);
+
+	const GcClock::time_point start = GcClock::now();
 #ifdef DEBUG_LOG_GC
 	grey();
 	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
+	white();
 #endif
 
-	markRoots();
-	traceReferences();
-	vm.strings.removeWhite();
-	sweep();
+	vm.markValue = !vm.markValue;
+	vm.gcPhase = GC_MARK;
+	markRoots(vm);
+	vm.nextGCStep = vm.bytesAllocated + GC_STEP_SIZE;
+	recordPause(vm, start);
+}
+
+static bool outOfTime(GcClock::time_point deadline, bool bounded, int& work)
+{
+	return bounded && ++work % GC_SLICE_CHECK == 0 && GcClock::now() >= deadline;
+}
+
+// traces gray objects until the deadline, returns true once the gray stack ran empty
+static bool markSlice(VM& vm, GcClock::time_point deadline, bool bounded)
+{
+	// the write barrier re-grays black objects that were given a white reference
+	blackenRemembered(vm);
+
+	int work = 0;
+	while (vm.grayCount > 0)
+	{
+		if (outOfTime(deadline, bounded, work)) return false;
+		blackenObject(vm, vm.grayStack[--vm.grayCount]);
+	}
+	return true;
+}
+
+static void finishMarking(VM& vm)
+{
+	// roots aren't covered by the write barrier, so they are rescanned atomically
+	markRoots(vm);
+	blackenRemembered(vm);
+	traceReferences(vm);
+	vm.strings.removeWhite(vm);
+
+	// detach everything that existed during marking, objects allocated from here on don't get swept
+	vm.sweepObjects = vm.objects;
+	vm.sweepOldObjects = vm.oldObjects;
+	vm.objects = nullptr;
+	vm.oldObjects = nullptr;
+	vm.gcPhase = GC_SWEEP;
+}
+
+// frees unmarked objects from the detached lists until the deadline, returns true once both are empty
+// marked objects stay marked and end up in the old generation
+static bool sweepSlice(VM& vm, GcClock::time_point deadline, bool bounded)
+{
+	int work = 0;
+	for (Obj** list : { &vm.sweepOldObjects, &vm.sweepObjects })
+	{
+		while (*list != nullptr)
+		{
+			if (outOfTime(deadline, bounded, work)) return false;
+
+			Obj* object = *list;
+			*list = object->next;
+			if (isMarked(vm, object))
+			{
+				object->next = vm.oldObjects;
+				vm.oldObjects = object;
+			}
+			else
+			{
+				freeObject(vm, object);
+			}
+		}
+	}
+	return true;
+}
 
+static void finishCollection(VM& vm)
+{
+	vm.gcPhase = GC_IDLE;
 	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
 
 #ifdef DEBUG_LOG_GC
+	grey();
 	printf("-- gc end\n");
-	if (before != vm.bytesAllocated) white();
-
-	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-		before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 	white();
+	printf("   heap is %zu bytes, next at %zu\n", vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
+// does one slice of work of the running full collection, bounded by vm.gcPauseBudget
+static void collectionStep(VM& vm, bool bounded)
+{
+	const GcClock::time_point start = GcClock::now();
+	const GcClock::time_point deadline = start + std::chrono::microseconds(vm.gcPauseBudget);
+
+	if (vm.gcPhase == GC_MARK)
+	{
+		if (markSlice(vm, deadline, bounded)) finishMarking(vm);
+	}
+	else if (vm.gcPhase == GC_SWEEP)
+	{
+		if (sweepSlice(vm, deadline, bounded)) finishCollection(vm);
+	}
+
+	vm.nextGCStep = vm.bytesAllocated + GC_STEP_SIZE;
+	recordPause(vm, start);
+}
+
+// full collection of both generations in one go, finishing the running incremental one if there is any
+void collectGarbage(VM& vm)
+{
+	if (vm.gcPhase == GC_IDLE) beginCollection(vm);
+	while (vm.gcPhase != GC_IDLE)
+	{
+		collectionStep(vm, false);
+	}
+}
 
-void freeObjects()
+void printGcStats(const VM& vm)
+{
+	static const char* bucketNames[GC_PAUSE_BUCKETS] = { "< 1us", "< 10us", "< 100us", "< 1ms", "< 10ms", ">= 10ms" };
+
+	size_t count = 0;
+	for (const size_t pauses : vm.gcPauses) count += pauses;
+
+	printf("gc pauses: %zu, total %.0fus, max %.0fus (budget %dus)\n", count, vm.gcTotalPause, vm.gcMaxPause, vm.gcPauseBudget);
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+	{
+		printf("  %-8s %zu\n", bucketNames[i], vm.gcPauses[i]);
+	}
+}
+
+static void freeList(VM& vm, Obj* object)
 {
-	Obj* object = vm.objects;
 	while (object != nullptr)
 	{
 		Obj* next = object->next;
-		freeObject(object);
+		freeObject(vm, object);
 		object = next;
 	}
+}
+
+void freeObjects(VM& vm)
+{
+	freeList(vm, vm.objects);
+	freeList(vm, vm.oldObjects);
+	freeList(vm, vm.sweepObjects);
+	freeList(vm, vm.sweepOldObjects);
 
 	free(vm.grayStack);
-}
+	free(vm.rememberedSet);
 
+	char* page = vm.pool.pages;
+	while (page != nullptr)
+	{
+		char* next = *reinterpret_cast<char**>(page);
+		free(page);
+		page = next;
+	}
+}
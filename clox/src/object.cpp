@@ -1,8 +1,13 @@
 #include "object.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
 #include "memory.h"
 #include "table.h"
 #include "util.h"
@@ -11,14 +16,15 @@
 
 
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type)
+static Obj* allocateObject(VM& vm, size_t size, ObjType type)
 {
-	Obj* object = (Obj*)reallocate(nullptr, 0, size);
+	Obj* object = (Obj*)reallocate(vm, nullptr, 0, size);
 	object->type = type;
-	object->isMarked = false;
+	object->mark = !vm.markValue;
+	object->isRemembered = false;
 
 	object->next = vm.objects;
 	vm.objects = object;
@@ -33,115 +39,370 @@ static Obj* allocateObject(size_t size, ObjType type)
 	return object;
 }
 
-ObjClass* newClass(ObjString* name)
+static ObjShape* newShape(VM& vm, ObjShape* parent, ObjString* name)
+{
+	ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+	shape->parent = parent;
+	shape->name = name;
+	shape->fieldCount = parent != nullptr ? parent->fieldCount + 1 : 0;
+	new(&shape->transitions) Table(vm);
+	return shape;
+}
+
+ObjClass* newClass(VM& vm, ObjString* name)
 {
-	ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+	push(vm, OBJ_VAL(newShape(vm, nullptr, nullptr)));
+	ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
 	klass->name = name;
+	klass->shape = reinterpret_cast<ObjShape*>(AS_OBJ(pop(vm)));
+	klass->inlineFieldCount = 0;
 	return klass;
 }
 
-ObjClosure* newClosure(ObjFunction* function)
+ObjClosure* newClosure(VM& vm, ObjFunction* function)
 {
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+	if (function->closure != nullptr) return function->closure;
+
+	ObjClosure* closure = reinterpret_cast<ObjClosure*>(allocateObject(vm, closureSize(function->upvalueCount), OBJ_CLOSURE));
+	closure->function = function;
+	closure->upvalueCount = function->upvalueCount;
 	for (int i = 0; i < function->upvalueCount; i++)
 	{
-		upvalues[i] = nullptr;
+		closure->upvalues[i] = nullptr;
+	}
+
+	if (function->upvalueCount == 0)
+	{
+		function->closure = closure;
+		writeBarrier(vm, reinterpret_cast<Obj*>(function), OBJ_VAL(closure));
 	}
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-	closure->function = function;
-	closure->upvalues = upvalues;
-	closure->upvalueCount = function->upvalueCount;
 	return closure;
 }
 
-ObjFunction* newFunction()
+ObjFunction* newFunction(VM& vm)
 {
-	auto* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+	auto* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 	//auto* function = new(mem) ObjFunction(); this fucks up the object type enum
 	//assert(mem == function);
 	function->arity = 0;
 	function->upvalueCount = 0;
 	function->name = nullptr;
-	auto* ptr = new (&function->chunk) Chunk();
+	function->closure = nullptr;
+	auto* ptr = new (&function->chunk) Chunk(vm);
 	assert(ptr == &function->chunk);
 	return function;
 }
 
-ObjInstance* newInstance(ObjClass* klass)
+ObjInstance* newInstance(VM& vm, ObjClass* klass)
 {
-	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	// the fields are stored directly after the instance, sized by what earlier instances of the class needed
+	const int inlineCapacity = klass->inlineFieldCount;
+	ObjInstance* instance = static_cast<ObjInstance*>(static_cast<void*>(
+		allocateObject(vm, sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE)));
 	assert(instance != nullptr);
 	instance->klass = klass;
-	new(&instance->fields) Table();
+	instance->shape = klass->shape;
+	instance->fields = reinterpret_cast<Value*>(instance + 1);
+	instance->fieldCapacity = inlineCapacity;
+	instance->inlineCapacity = inlineCapacity;
 	return instance;
 }
 
-ObjNative* newNative(NativeFn function)
+int findField(const ObjShape* shape, const ObjString* name)
+{
+	for (; shape->name != nullptr; shape = shape->parent)
+	{
+		if (shape->name == name) return shape->fieldCount - 1;
+	}
+	return -1;
+}
+
+bool getField(const ObjInstance* instance, const ObjString* name, Value* out_value)
 {
-	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+	const int slot = findField(instance->shape, name);
+	if (slot == -1) return false;
+
+	*out_value = instance->fields[slot];
+	return true;
+}
+
+void setField(VM& vm, ObjInstance* instance, ObjString* name, Value value)
+{
+	const int slot = findField(instance->shape, name);
+	if (slot != -1)
+	{
+		instance->fields[slot] = value;
+		writeBarrier(vm, reinterpret_cast<Obj*>(instance), value);
+		return;
+	}
+
+	// follow (or create) the transition that adds this field
+	ObjShape* shape = instance->shape;
+	Value next;
+	if (!shape->transitions.get(name, &next))
+	{
+		next = OBJ_VAL(newShape(vm, shape, name));
+		push(vm, next);
+		shape->transitions.set(name, next);
+		writeBarrier(vm, reinterpret_cast<Obj*>(shape), next);
+		pop(vm);
+	}
+	ObjShape* nextShape = reinterpret_cast<ObjShape*>(AS_OBJ(next));
+
+	if (nextShape->fieldCount > instance->fieldCapacity)
+	{
+		const int capacity = GROW_CAPACITY(instance->fieldCapacity);
+		Value* fields = ALLOCATE(vm, Value, capacity);
+		for (int i = 0; i < shape->fieldCount; i++)
+		{
+			fields[i] = instance->fields[i];
+		}
+		if (instance->fieldCapacity > instance->inlineCapacity)
+		{
+			FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+		}
+		instance->fields = fields;
+		instance->fieldCapacity = capacity;
+	}
+
+	instance->fields[shape->fieldCount] = value;
+	instance->shape = nextShape;
+	writeBarrier(vm, reinterpret_cast<Obj*>(instance), value);
+	writeBarrier(vm, reinterpret_cast<Obj*>(instance), next);
+
+	updateInlineFieldCount(instance->klass, nextShape);
+}
+
+ObjNative* newNative(VM& vm, NativeFn function)
+{
+	ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
 	native->function = function;
 	return native;
 }
 
-static ObjString* allocateString(char* chars, size_t length, uint32_t hash)
+ObjString* newString(VM& vm, size_t length)
 {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	ObjString* string = reinterpret_cast<ObjString*>(allocateObject(vm, stringSize(length), OBJ_STRING));
 	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
+	string->hash = 0;
+	string->interned = false;
+	string->chars[length] = '\0';
+	return string;
+}
 
-	push(OBJ_VAL(string));
-	vm.strings.set(string, NIL_VAL);
-	pop();
 
-	return string;
+static uint64_t read64(const char* p)
+{
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
 }
 
+static uint64_t read32(const char* p)
+{
+	uint32_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
 
+// the full 128 bit product of a and b, low half in a and high half in b
+static void multiply128(uint64_t& a, uint64_t& b)
+{
+#if defined(__SIZEOF_INT128__)
+	const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+	a = static_cast<uint64_t>(product);
+	b = static_cast<uint64_t>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	a = _umul128(a, b, &b);
+#else
+	const uint64_t aHigh = a >> 32, aLow = static_cast<uint32_t>(a);
+	const uint64_t bHigh = b >> 32, bLow = static_cast<uint32_t>(b);
+	const uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow, middle1 = aLow * bHigh, low = aLow * bLow;
+	const uint64_t cross = (low >> 32) + static_cast<uint32_t>(middle0) + middle1;
+	a = (cross << 32) | static_cast<uint32_t>(low);
+	b = high + (middle0 >> 32) + (cross >> 32);
+#endif
+}
+
+static uint64_t mix(uint64_t a, uint64_t b)
+{
+	multiply128(a, b);
+	return a ^ b;
+}
+
+// wyhash (final version 4) with a seed of 0, folded to 32 bits
 uint32_t hashString(const char* key, const size_t length)
 {
-	uint32_t hash = 2166136261u;
-	for (size_t i = 0; i < length; i++)
+	constexpr uint64_t secret[4] = { 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull };
+
+	const auto* p = reinterpret_cast<const uint8_t*>(key);
+	uint64_t seed = mix(secret[0], secret[1]);
+	uint64_t a, b;
+	if (length <= 16)
+	{
+		if (length >= 4)
+		{
+			const size_t step = (length >> 3) << 2;
+			a = read32(key) << 32 | read32(key + step);
+			b = read32(key + length - 4) << 32 | read32(key + length - 4 - step);
+		}
+		else if (length > 0)
+		{
+			a = static_cast<uint64_t>(p[0]) << 16 | static_cast<uint64_t>(p[length >> 1]) << 8 | p[length - 1];
+			b = 0;
+		}
+		else
+		{
+			a = b = 0;
+		}
+	}
+	else
 	{
-		hash ^= static_cast<uint8_t>(key[i]);
-		hash *= 16777619;
+		const char* q = key;
+		size_t left = length;
+		// long strings are hashed in three independent lanes, so the multiplies don't wait on each other
+		if (left >= 48)
+		{
+			uint64_t seed1 = seed, seed2 = seed;
+			do
+			{
+				seed = mix(read64(q) ^ secret[1], read64(q + 8) ^ seed);
+				seed1 = mix(read64(q + 16) ^ secret[2], read64(q + 24) ^ seed1);
+				seed2 = mix(read64(q + 32) ^ secret[3], read64(q + 40) ^ seed2);
+				q += 48;
+				left -= 48;
+			} while (left >= 48);
+			seed ^= seed1 ^ seed2;
+		}
+		for (; left > 16; q += 16, left -= 16)
+		{
+			seed = mix(read64(q) ^ secret[1], read64(q + 8) ^ seed);
+		}
+		// the last 16 bytes, overlapping what was already hashed
+		a = read64(q + left - 16);
+		b = read64(q + left - 8);
 	}
-	return hash;
+
+	a ^= secret[1];
+	b ^= seed;
+	multiply128(a, b);
+	const uint64_t hash = mix(a ^ secret[0] ^ length, b ^ secret[1]);
+	return static_cast<uint32_t>(hash ^ (hash >> 32));
 }
 
-ObjString* takeString(char* chars, const size_t length)
+// runtime strings are hashed the first time they're compared, later comparisons mostly stop at the hash
+static uint32_t stringHash(ObjString* string)
 {
-	const uint32_t hash = hashString(chars, length);
-	ObjString* interned = vm.strings.findString(chars, length, hash);
-	if (interned != nullptr)
-	{
-		FREE_ARRAY(char, chars, length + 1);
-		return interned;
-	}
-	return allocateString(chars, length, hash);
+	if (string->hash == 0) string->hash = hashString(string->chars, string->length);
+	return string->hash;
+}
+
+bool stringsEqual(ObjString* a, ObjString* b)
+{
+	if (a == b) return true;
+	// there's only one interned string with these characters
+	if (a->interned && b->interned) return false;
+	if (a->length != b->length) return false;
+	if (stringHash(a) != stringHash(b)) return false;
+	return memcmp(a->chars, b->chars, a->length) == 0;
 }
 
-ObjString* copyString(const char* chars, size_t length)
+ObjString* copyString(VM& vm, const char* chars, size_t length)
 {
-	uint32_t hash = hashString(chars, length);
+	const uint32_t hash = hashString(chars, length);
 	ObjString* interned = vm.strings.findString(chars, length, hash);
 	if (interned != nullptr) { return interned; }
 
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	ObjString* string = newString(vm, length);
+	memcpy(string->chars, chars, length);
+	string->hash = hash;
+	string->interned = true;
+	vm.strings.set(string, NIL_VAL);
+	return string;
 }
 
-ObjUpvalue* newUpvalue(Value* slot)
+ObjUpvalue* newUpvalue(VM& vm, Value* slot)
 {
-	ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+	ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
 	upvalue->closed = NIL_VAL;
 	upvalue->location = slot;
 	upvalue->next = nullptr;
 	return upvalue;
 }
 
+ObjRope* newRope(VM& vm, Value left, Value right)
+{
+	// ropes that were flattened in the meantime are replaced by their string
+	if (IS_ROPE(left) && AS_ROPE(left)->flat != nullptr) left = OBJ_VAL(AS_ROPE(left)->flat);
+	if (IS_ROPE(right) && AS_ROPE(right)->flat != nullptr) right = OBJ_VAL(AS_ROPE(right)->flat);
+
+	int depth = IS_ROPE(left) ? AS_ROPE(left)->depth : 0;
+	if (IS_ROPE(right))
+	{
+		int rightDepth = AS_ROPE(right)->depth + 1;
+		if (rightDepth > ROPE_MAX_DEPTH)
+		{
+			right = OBJ_VAL(flattenRope(vm, AS_ROPE(right)));
+			rightDepth = 0;
+		}
+		if (rightDepth > depth) depth = rightDepth;
+	}
+
+	ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+	rope->length = stringLength(left) + stringLength(right);
+	rope->depth = depth;
+	rope->left = left;
+	rope->right = right;
+	rope->flat = nullptr;
+	return rope;
+}
+
+// writes the characters of the rope to dest, which has room for rope->length of them
+// concatenating in a loop builds ropes that lean left, so those are followed in a loop and only right operands recurse
+static void copyRope(const ObjRope* rope, char* dest)
+{
+	for (;;)
+	{
+		if (rope->flat != nullptr)
+		{
+			memcpy(dest, rope->flat->chars, rope->length);
+			return;
+		}
+
+		const size_t leftLength = stringLength(rope->left);
+		if (IS_STRING(rope->right))
+		{
+			memcpy(dest + leftLength, AS_CSTRING(rope->right), AS_STRING(rope->right)->length);
+		}
+		else
+		{
+			copyRope(AS_ROPE(rope->right), dest + leftLength);
+		}
+
+		if (IS_STRING(rope->left))
+		{
+			memcpy(dest, AS_CSTRING(rope->left), leftLength);
+			return;
+		}
+		rope = AS_ROPE(rope->left);
+	}
+}
+
+ObjString* flattenRope(VM& vm, ObjRope* rope)
+{
+	if (rope->flat != nullptr) return rope->flat;
+
+	ObjString* string = newString(vm, rope->length);
+	copyRope(rope, string->chars);
+
+	// the pieces aren't needed anymore, the rope stays around as long as values still point to it
+	rope->flat = string;
+	rope->left = NIL_VAL;
+	rope->right = NIL_VAL;
+	writeBarrier(vm, reinterpret_cast<Obj*>(rope), OBJ_VAL(rope->flat));
+	return rope->flat;
+}
+
 static void printFunction(ObjFunction* function)
 {
 	if (function->name == nullptr)
@@ -171,6 +432,25 @@ void printObject(Value value)
 	case OBJ_NATIVE:
 		printf("<native fn>");
 		break;
+	case OBJ_ROPE:
+	{
+		// printing doesn't flatten, the result would have to be allocated through the vm
+		const ObjRope* rope = AS_ROPE(value);
+		if (rope->flat != nullptr)
+		{
+			printf("%s", rope->flat->chars);
+			break;
+		}
+		char* chars = static_cast<char*>(malloc(rope->length));
+		if (chars == nullptr) exit(1);
+		copyRope(rope, chars);
+		fwrite(chars, 1, rope->length, stdout);
+		free(chars);
+		break;
+	}
+	case OBJ_SHAPE:
+		printf("shape");
+		break;
 	case OBJ_STRING:
 		printf("%s", AS_CSTRING(value));
 		break;
@@ -0,0 +1,353 @@
+#include "optimizer.h"
+
+#include <cstring>
+
+#include "object.h"
+
+struct Instruction
+{
+	size_t offset; // in the original code
+	size_t length;
+	size_t line;
+	size_t target; // index of the instruction a jump lands on
+	uint8_t op;
+	bool removed;
+};
+
+static size_t instructionLength(const Chunk& chunk, const size_t offset)
+{
+	switch (chunk.code[offset])
+	{
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_CLASS:
+	case OP_ADD_CONSTANT:
+	case OP_SUBTRACT_CONSTANT:
+	case OP_LESS_CONSTANT:
+	case OP_SET_LOCAL_POP:
+		return 2;
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_SET_GLOBAL_POP:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_JUMP_UNLESS_EQUAL:
+	case OP_JUMP_UNLESS_NOT_EQUAL:
+	case OP_JUMP_UNLESS_GREATER:
+	case OP_JUMP_UNLESS_LESS:
+	case OP_JUMP_UNLESS_GREATER_EQUAL:
+	case OP_JUMP_UNLESS_LESS_EQUAL:
+		return 3;
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_PROPERTY_MONO:
+	case OP_JUMP_UNLESS_LESS_CONSTANT:
+		return 4;
+	case OP_CLOSURE:
+		return 2 + 2 * AS_FUNCTION(chunk.constants[chunk.code[offset + 1]])->upvalueCount;
+	default:
+		return 1;
+	}
+}
+
+// the fused compare-and-branch jumps, they check their operand types even when they don't jump
+static bool isCompareJump(const uint8_t op)
+{
+	switch (op)
+	{
+	case OP_JUMP_UNLESS_EQUAL:
+	case OP_JUMP_UNLESS_NOT_EQUAL:
+	case OP_JUMP_UNLESS_GREATER:
+	case OP_JUMP_UNLESS_LESS:
+	case OP_JUMP_UNLESS_GREATER_EQUAL:
+	case OP_JUMP_UNLESS_LESS_EQUAL:
+	case OP_JUMP_UNLESS_LESS_CONSTANT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// the jump offset is always the last two bytes of the instruction
+static bool isJump(const uint8_t op)
+{
+	return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE || isCompareJump(op);
+}
+
+// control never falls through to the next instruction
+static bool isUnconditional(const uint8_t op)
+{
+	return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+// the first instruction at or after index that's still there, or the end
+static size_t resolve(const Blob<Instruction>& code, size_t index)
+{
+	while (index < code.size() && code[index].removed) index++;
+	return index;
+}
+
+static void countTargets(Blob<Instruction>& code, Blob<size_t>& targeted)
+{
+	for (size_t i = 0; i <= code.size(); i++) targeted[i] = 0;
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		Instruction& instruction = code[i];
+		if (instruction.removed || !isJump(instruction.op)) continue;
+		instruction.target = resolve(code, instruction.target);
+		targeted[instruction.target]++;
+	}
+}
+
+// jump distances only shrink once code is removed, so the original offsets give an upper bound
+static bool inRange(const Blob<Instruction>& code, const size_t from, const size_t to, const size_t end)
+{
+	const size_t source = code[from].offset + code[from].length;
+	const size_t destination = to < code.size() ? code[to].offset : end;
+	const size_t distance = destination > source ? destination - source : source - destination;
+	return distance <= UINT16_MAX;
+}
+
+// one round of rewrites, returns true if anything changed
+static bool rewrite(Blob<Instruction>& code, Blob<size_t>& targeted, const size_t end)
+{
+	bool changed = false;
+	countTargets(code, targeted);
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		Instruction& instruction = code[i];
+		if (instruction.removed) continue;
+
+		const size_t nextIndex = resolve(code, i + 1);
+		Instruction* next = nextIndex < code.size() && targeted[nextIndex] == 0 ? &code[nextIndex] : nullptr;
+
+		// a comparison followed by a not becomes the opposite comparison
+		if (next != nullptr && next->op == OP_NOT)
+		{
+			uint8_t fused = 0;
+			if (instruction.op == OP_EQUAL) fused = OP_NOT_EQUAL;
+			if (instruction.op == OP_LESS) fused = OP_GREATER_EQUAL;
+			if (instruction.op == OP_GREATER) fused = OP_LESS_EQUAL;
+			if (instruction.op == OP_NOT_EQUAL) fused = OP_EQUAL;
+			if (instruction.op == OP_GREATER_EQUAL) fused = OP_LESS;
+			if (instruction.op == OP_LESS_EQUAL) fused = OP_GREATER;
+			if (fused != 0)
+			{
+				instruction.op = fused;
+				next->removed = true;
+				changed = true;
+				continue;
+			}
+		}
+
+		if (!isJump(instruction.op)) continue;
+
+		// thread jumps that land on another jump, conditional jumps have to stay forward
+		const bool unconditional = instruction.op == OP_JUMP || instruction.op == OP_LOOP;
+		for (size_t steps = 0; steps < code.size() && instruction.target < code.size(); steps++)
+		{
+			const Instruction& landing = code[instruction.target];
+			const size_t target = resolve(code, landing.target);
+			const bool follow = landing.op == OP_JUMP
+				|| (landing.op == OP_LOOP && unconditional)
+				|| (landing.op == OP_JUMP_IF_FALSE && instruction.op == OP_JUMP_IF_FALSE); // tests the same value again
+			if (!follow || target == instruction.target || !inRange(code, i, target, end)) break;
+			if (!unconditional && target <= i) break;
+
+			targeted[instruction.target]--;
+			instruction.target = target;
+			targeted[instruction.target]++;
+			changed = true;
+		}
+
+		// a jump to the next instruction does nothing, the popping one still has to pop
+		// and the comparing ones still have to check their operand types
+		if (instruction.target == nextIndex && !isCompareJump(instruction.op))
+		{
+			targeted[instruction.target]--;
+			if (instruction.op == OP_POP_JUMP_IF_FALSE)
+			{
+				instruction.op = OP_POP;
+			}
+			else
+			{
+				instruction.removed = true;
+			}
+			changed = true;
+			continue;
+		}
+
+		// a conditional jump that pops on both paths: the pop at the target can only be reached through this jump
+		if (instruction.op == OP_JUMP_IF_FALSE && next != nullptr && next->op == OP_POP && instruction.target > nextIndex
+			&& instruction.target < code.size() && code[instruction.target].op == OP_POP && targeted[instruction.target] == 1)
+		{
+			size_t before = instruction.target - 1;
+			while (code[before].removed) before--;
+			if (isUnconditional(code[before].op))
+			{
+				instruction.op = OP_POP_JUMP_IF_FALSE;
+				next->removed = true;
+				code[instruction.target].removed = true;
+				instruction.target = resolve(code, instruction.target);
+				changed = true;
+				continue;
+			}
+		}
+	}
+
+	// code after an unconditional transfer is dead until something jumps to it
+	countTargets(code, targeted);
+	bool dead = false;
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		Instruction& instruction = code[i];
+		if (instruction.removed) continue;
+
+		if (dead && targeted[i] == 0)
+		{
+			instruction.removed = true;
+			changed = true;
+			continue;
+		}
+		dead = isUnconditional(instruction.op);
+	}
+
+	return changed;
+}
+
+// pairs picked from --op-stats counts on the benchmark scripts
+// the fused instruction takes the operands of the first one followed by those of the second one
+// the fused instruction reports the line of the half that can raise a runtime error
+struct Superinstruction
+{
+	uint8_t first;
+	uint8_t second;
+	uint8_t fused;
+	bool firstRaises;
+};
+
+static const Superinstruction superinstructions[] = {
+	{ OP_CONSTANT, OP_ADD, OP_ADD_CONSTANT, false },
+	{ OP_CONSTANT, OP_SUBTRACT, OP_SUBTRACT_CONSTANT, false },
+	{ OP_CONSTANT, OP_LESS, OP_LESS_CONSTANT, false },
+	{ OP_SET_LOCAL, OP_POP, OP_SET_LOCAL_POP, true },
+	{ OP_SET_GLOBAL, OP_POP, OP_SET_GLOBAL_POP, true },
+	{ OP_CONSTANT, OP_JUMP_UNLESS_LESS, OP_JUMP_UNLESS_LESS_CONSTANT, false },
+};
+
+static void fuseSuperinstructions(Blob<Instruction>& code, Blob<size_t>& targeted)
+{
+	countTargets(code, targeted);
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		Instruction& instruction = code[i];
+		if (instruction.removed) continue;
+
+		const size_t nextIndex = resolve(code, i + 1);
+		if (nextIndex == code.size() || targeted[nextIndex] != 0) continue;
+
+		Instruction& next = code[nextIndex];
+		for (const Superinstruction& superinstruction : superinstructions)
+		{
+			if (instruction.op != superinstruction.first || next.op != superinstruction.second) continue;
+
+			// the second opcode is dropped, and a jump offset gets patched over the last two bytes anyway
+			instruction.op = superinstruction.fused;
+			instruction.length += next.length - 1;
+			if (!superinstruction.firstRaises) instruction.line = next.line;
+			instruction.target = next.target;
+			next.removed = true;
+			break;
+		}
+	}
+}
+
+void optimizeChunk(Chunk& chunk)
+{
+	const size_t end = chunk.count();
+
+	// decode, the extra entry in offsetIndex maps the end of the code
+	Blob<Instruction> code;
+	Blob<size_t> offsetIndex;
+	for (size_t offset = 0; offset < end;)
+	{
+		const size_t length = instructionLength(chunk, offset);
+		for (size_t i = 0; i < length; i++) offsetIndex.write(code.size());
+		code.write(Instruction{ offset, length, chunk.getLine(offset), 0, chunk.code[offset], false });
+		offset += length;
+	}
+	offsetIndex.write(code.size());
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		Instruction& instruction = code[i];
+		if (!isJump(instruction.op)) continue;
+
+		const size_t source = instruction.offset + instruction.length;
+		const size_t distance = static_cast<size_t>(chunk.code[source - 2] << 8 | chunk.code[source - 1]);
+		instruction.target = offsetIndex[instruction.op == OP_LOOP ? source - distance : source + distance];
+	}
+
+	Blob<size_t> targeted;
+	for (size_t i = 0; i <= code.size(); i++) targeted.write(0);
+	while (rewrite(code, targeted, end));
+	fuseSuperinstructions(code, targeted);
+
+	// new offsets, everything only moves towards the start so the code can be rewritten in place
+	Blob<size_t>& newOffset = offsetIndex;
+	size_t offset = 0;
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		newOffset[i] = offset;
+		if (!code[i].removed) offset += code[i].length;
+	}
+	newOffset[code.size()] = offset;
+
+	chunk.lines.truncate(0);
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		const Instruction& instruction = code[i];
+		if (instruction.removed) continue;
+
+		uint8_t* bytes = &chunk.code[newOffset[i]];
+		memmove(bytes, &chunk.code[instruction.offset], instruction.length);
+		bytes[0] = instruction.op;
+
+		if (isJump(instruction.op))
+		{
+			const size_t source = newOffset[i] + instruction.length;
+			const size_t destination = newOffset[instruction.target];
+			size_t distance = destination - source;
+			if (destination < source)
+			{
+				// threading can turn a forward jump into a backward one
+				bytes[0] = OP_LOOP;
+				distance = source - destination;
+			}
+			else if (instruction.op == OP_LOOP)
+			{
+				bytes[0] = OP_JUMP;
+			}
+			bytes[instruction.length - 2] = (distance >> 8) & 0xff;
+			bytes[instruction.length - 1] = distance & 0xff;
+		}
+
+		const size_t lineCount = chunk.lines.size();
+		if (lineCount == 0 || chunk.lines[lineCount - 1].line != instruction.line)
+		{
+			chunk.lines.write(LineStart{ static_cast<uint32_t>(newOffset[i]), static_cast<uint32_t>(instruction.line) });
+		}
+	}
+	chunk.code.truncate(offset);
+}
@@ -1,16 +1,7 @@
 ﻿#include "scanner.h"
 
 
-struct Scanner
-{
-	const char* start;
-	const char* current;
-	int line;
-};
-
-Scanner scanner;
-
-void initScanner(const std::string& source)
+void initScanner(Scanner& scanner, const std::string& source)
 {
 	scanner.start = source.c_str();
 	scanner.current = scanner.start;
@@ -25,64 +16,64 @@ static bool isAlpha(const char c)
 }
 
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner& scanner)
 {
 	return *scanner.current == '\0';
 }
 
-static char advance()
+static char advance(Scanner& scanner)
 {
 	return *scanner.current++;
 }
 
-static char peek()
+static char peek(Scanner& scanner)
 {
 	return *scanner.current;
 }
 
-static char peekNext()
+static char peekNext(Scanner& scanner)
 {
-	if (isAtEnd()) return '\0';
+	if (isAtEnd(scanner)) return '\0';
 	return scanner.current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner& scanner, char expected)
 {
-	if (isAtEnd()) return false;
+	if (isAtEnd(scanner)) return false;
 	if (*scanner.current != expected) return false;
 	scanner.current++;
 	return true;
 }
 
-static Token makeToken(const TokenType type)
+static Token makeToken(Scanner& scanner, const TokenType type)
 {
 	return { type,	scanner.start,	static_cast<size_t>(scanner.current - scanner.start),	scanner.line };
 }
 
-static Token errorToken(const char* message)
+static Token errorToken(Scanner& scanner, const char* message)
 {
 	return { TOKEN_ERROR, message, strlen(message), scanner.line };
 }
 
-static void skipWhitespace()
+static void skipWhitespace(Scanner& scanner)
 {
 	while (true)
 	{
-		switch (peek())
+		switch (peek(scanner))
 		{
 		case ' ':
 		case '\r':
 		case '\t':
-			advance();
+			advance(scanner);
 			break;
 		case '\n':
 			scanner.line++;
-			advance();
+			advance(scanner);
 			break;
 		case '/':
-			if (peekNext() == '/')
+			if (peekNext(scanner) == '/')
 			{
-				while (peek() != '\n' && !isAtEnd()) advance();
+				while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
 				break;
 			}
 			return;
@@ -92,9 +83,9 @@ static void skipWhitespace()
 	}
 }
 
-static TokenType identifierType()
+static TokenType identifierType(Scanner& scanner)
 {
-	auto checkKeyword = [](const size_t start, const size_t length, const char* rest, const TokenType type)
+	auto checkKeyword = [&scanner](const size_t start, const size_t length, const char* rest, const TokenType type)
 	{
 		if (static_cast<size_t>(scanner.current - scanner.start) == start + length && memcmp(scanner.start + start, rest, length) == 0)
 		{
@@ -142,77 +133,77 @@ static TokenType identifierType()
 	return TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner& scanner)
 {
-	while (isAlpha(peek()) || isdigit(peek())) advance();
-	return makeToken(identifierType());
+	while (isAlpha(peek(scanner)) || isdigit(peek(scanner))) advance(scanner);
+	return makeToken(scanner, identifierType(scanner));
 }
 
-static Token string()
+static Token string(Scanner& scanner)
 {
-	while (peek() != '"' && !isAtEnd())
+	while (peek(scanner) != '"' && !isAtEnd(scanner))
 	{
-		if (peek() == '\n') scanner.line++;
-		advance();
+		if (peek(scanner) == '\n') scanner.line++;
+		advance(scanner);
 	}
 
-	if (isAtEnd()) return errorToken("Unterminated string.");
+	if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
 	// the closing quote
-	advance();
-	return makeToken(TOKEN_STRING);
+	advance(scanner);
+	return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number()
+static Token number(Scanner& scanner)
 {
-	while (isdigit(peek())) advance();
+	while (isdigit(peek(scanner))) advance(scanner);
 
-	if (peek() == '.' && isdigit(peekNext()))
+	if (peek(scanner) == '.' && isdigit(peekNext(scanner)))
 	{
-		advance();
+		advance(scanner);
 
-		while (isdigit(peek())) advance();
+		while (isdigit(peek(scanner))) advance(scanner);
 	}
 
-	return makeToken(TOKEN_NUMBER);
+	return makeToken(scanner, TOKEN_NUMBER);
 }
 
-Token scanToken()
+Token scanToken(Scanner& scanner)
 {
-	skipWhitespace();
+	skipWhitespace(scanner);
 	scanner.start = scanner.current;
 
-	if (isAtEnd()) return makeToken(TOKEN_EOF);
+	if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-	const char c = advance();
-	if (isAlpha(c)) return identifier();
-	if (isdigit(c)) return number();
+	const char c = advance(scanner);
+	if (isAlpha(c)) return identifier(scanner);
+	if (isdigit(c)) return number(scanner);
 	switch (c)
 	{
-	case '(': return makeToken(TOKEN_LEFT_PAREN);
-	case ')': return makeToken(TOKEN_RIGHT_PAREN);
-	case '{': return makeToken(TOKEN_LEFT_BRACE);
-	case '}': return makeToken(TOKEN_RIGHT_BRACE);
-	case ';': return makeToken(TOKEN_SEMICOLON);
-	case ',': return makeToken(TOKEN_COMMA);
-	case '.': return makeToken(TOKEN_DOT);
-	case '-': return makeToken(TOKEN_MINUS);
-	case '+': return makeToken(TOKEN_PLUS);
-	case '/': return makeToken(TOKEN_SLASH);
-	case '*': return makeToken(TOKEN_STAR);
+	case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+	case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+	case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+	case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+	case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+	case ',': return makeToken(scanner, TOKEN_COMMA);
+	case '.': return makeToken(scanner, TOKEN_DOT);
+	case '-': return makeToken(scanner, TOKEN_MINUS);
+	case '+': return makeToken(scanner, TOKEN_PLUS);
+	case '/': return makeToken(scanner, TOKEN_SLASH);
+	case '*': return makeToken(scanner, TOKEN_STAR);
 	case '!':
-		return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 	case '=':
-		return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 	case '<':
-		return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 	case '>':
-		return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
 	case '"':
-		return string();
+		return string(scanner);
 	}
 
-	return errorToken("Unexpected character.");
+	return errorToken(scanner, "Unexpected character.");
 }
 
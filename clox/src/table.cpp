@@ -1,5 +1,6 @@
 #include "table.h"
 
+#include <bit>
 #include <cstdlib>
 #include <cstring>
 
@@ -7,12 +8,289 @@
 #include "object.h"
 #include "value.h"
 
+// tables use the system allocator and report their size to the vm they belong to
+static void countBytes(VM* vm, const size_t oldSize, const size_t newSize)
+{
+	if (vm != nullptr) countExternal(*vm, oldSize, newSize);
+}
+
+#ifdef SWISS_TABLE
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+#define GROUP_SIZE 16
+// full slots hold the low 7 bits of the key's hash, so only the markers have the sign bit set
+#define CONTROL_EMPTY static_cast<int8_t>(-128)
+#define CONTROL_DELETED static_cast<int8_t>(-2)
+
+// the control bytes, keys and values of a table with this many slots
+#define BLOCK_SIZE(capacity) ((capacity) * (1 + sizeof(ObjString*) + sizeof(Value)))
+
+
+Table::~Table()
+{
+	countBytes(m_vm, BLOCK_SIZE(m_capacity), 0);
+	free(m_control);
+}
+
+
+// utility function ------------------------------------------------
+
+// bit i is set if the control byte of slot i of the group equals byte
+static uint32_t matchByte(const int8_t* group, const int8_t byte)
+{
+#ifdef TABLE_SSE2
+	const __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+	return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte))));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_SIZE; i++)
+	{
+		if (group[i] == byte) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// bit i is set if slot i of the group is empty or deleted
+static uint32_t matchFree(const int8_t* group)
+{
+#ifdef TABLE_SSE2
+	return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_SIZE; i++)
+	{
+		if (group[i] < 0) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+static int8_t hashFragment(const uint32_t hash)
+{
+	return static_cast<int8_t>(hash & 0x7f);
+}
+
+// the probe sequence visits whole groups, starting at the one picked by the hash bits above the fragment
+// triangular steps reach every group of a power of two table
+#define FOR_EACH_GROUP(hash, capacity, group) \
+	for (size_t group = ((hash) >> 7) & ((capacity) / GROUP_SIZE - 1), step = 1; ; \
+		group = (group + step++) & ((capacity) / GROUP_SIZE - 1))
+
+// first empty or deleted slot for a key with this hash, the table must have one
+static size_t findFree(const int8_t* control, const size_t capacity, const uint32_t hash)
+{
+	FOR_EACH_GROUP(hash, capacity, group)
+	{
+		const uint32_t freeSlots = matchFree(control + group * GROUP_SIZE);
+		if (freeSlots != 0) return group * GROUP_SIZE + std::countr_zero(freeSlots);
+	}
+}
+
+size_t Table::findSlot(const ObjString* key) const
+{
+	// keys are compared by identity, only interned strings can be keys
+	assert(key->interned);
+	if (m_count == 0) return m_capacity;
+
+	const int8_t fragment = hashFragment(key->hash);
+	FOR_EACH_GROUP(key->hash, m_capacity, group)
+	{
+		const int8_t* control = m_control + group * GROUP_SIZE;
+		for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1)
+		{
+			const size_t slot = group * GROUP_SIZE + std::countr_zero(match);
+			if (m_keys[slot] == key) return slot;
+		}
+		// an empty slot ends every probe sequence that reaches this group
+		if (matchByte(control, CONTROL_EMPTY) != 0) return m_capacity;
+	}
+}
+
+
+// operations ------------------------------------------------------
+
+bool Table::get(const ObjString* key, Value* out_value) const
+{
+	const size_t slot = findSlot(key);
+	if (slot == m_capacity) return false;
+
+	*out_value = m_values[slot];
+	return true;
+}
+
+bool Table::set(ObjString* key, Value value)
+{
+	if (const size_t slot = findSlot(key); slot != m_capacity)
+	{
+		m_values[slot] = value;
+		return false;
+	}
+
+	// full and deleted slots may take up 7/8 of the table
+	if (m_count + m_tombstones + 1 > m_capacity - m_capacity / 8)
+	{
+		// when it's mostly tombstones, rehashing at the same size makes enough room
+		const bool grow = m_capacity == 0 || m_count + 1 > (m_capacity - m_capacity / 8) / 2;
+		resize(grow ? (m_capacity == 0 ? GROUP_SIZE : m_capacity * 2) : m_capacity);
+	}
+
+	const size_t slot = findFree(m_control, m_capacity, key->hash);
+	if (m_control[slot] == CONTROL_DELETED) m_tombstones--;
+	m_control[slot] = hashFragment(key->hash);
+	m_keys[slot] = key;
+	m_values[slot] = value;
+	m_count++;
+	return true;
+}
+
+bool Table::del(const ObjString* key)
+{
+	const size_t slot = findSlot(key);
+	if (slot == m_capacity) return false;
+
+	// a group that still has an empty slot stops every probe anyway, so the slot can become empty again
+	int8_t* group = m_control + slot / GROUP_SIZE * GROUP_SIZE;
+	if (matchByte(group, CONTROL_EMPTY) != 0)
+	{
+		m_control[slot] = CONTROL_EMPTY;
+	}
+	else
+	{
+		m_control[slot] = CONTROL_DELETED;
+		m_tombstones++;
+	}
+	m_keys[slot] = nullptr;
+	m_count--;
+	return true;
+}
+
+// nts: should this take the argument "to" or "from"?
+void Table::addAll(Table& to) const
+{
+	for (size_t i = 0; i < m_capacity; i++)
+	{
+		if (m_control[i] >= 0) to.set(m_keys[i], m_values[i]);
+	}
+}
+
+ObjString* Table::findString(const char* chars, size_t length, uint32_t hash) const
+{
+	if (m_count == 0) return nullptr;
+
+	const int8_t fragment = hashFragment(hash);
+	FOR_EACH_GROUP(hash, m_capacity, group)
+	{
+		const int8_t* control = m_control + group * GROUP_SIZE;
+		for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1)
+		{
+			ObjString* key = m_keys[group * GROUP_SIZE + std::countr_zero(match)];
+			if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
+			{
+				return key;
+			}
+		}
+		if (matchByte(control, CONTROL_EMPTY) != 0) return nullptr;
+	}
+}
+
+void Table::removeWhite(const VM& vm)
+{
+	for (size_t i = 0; i < m_capacity; i++)
+	{
+		if (m_control[i] >= 0 && !isMarked(vm, &m_keys[i]->obj))
+		{
+			del(m_keys[i]);
+		}
+	}
+	compact();
+}
+
+void Table::compact()
+{
+	if (m_capacity == 0) return;
+
+	if (m_count == 0)
+	{
+		countBytes(m_vm, BLOCK_SIZE(m_capacity), 0);
+		free(m_control);
+		m_control = nullptr;
+		m_keys = nullptr;
+		m_values = nullptr;
+		m_capacity = 0;
+		m_tombstones = 0;
+		return;
+	}
+
+	// the smallest table that has the keys at most half of the maximum load
+	size_t capacity = GROUP_SIZE;
+	while ((capacity - capacity / 8) / 2 < m_count) capacity *= 2;
+
+	// a fourth is far enough from the growth threshold that a table doesn't keep shrinking and growing
+	if (capacity <= m_capacity / 4)
+	{
+		resize(capacity);
+	}
+	else if (m_tombstones > m_capacity / 4)
+	{
+		resize(m_capacity);
+	}
+}
+
+void Table::mark(VM& vm)
+{
+	for (size_t i = 0; i < m_capacity; i++)
+	{
+		if (m_control[i] < 0) continue;
+
+		markObject(vm, (Obj*)m_keys[i]);
+		markValue(vm, m_values[i]);
+	}
+}
+
+
+void Table::resize(size_t capacity)
+{
+	// the control bytes come first, a multiple of 16 of them keeps the other two arrays aligned
+	char* block = static_cast<char*>(malloc(BLOCK_SIZE(capacity)));
+	if (block == nullptr) exit(1);
+	countBytes(m_vm, BLOCK_SIZE(m_capacity), BLOCK_SIZE(capacity));
+	int8_t* control = reinterpret_cast<int8_t*>(block);
+	ObjString** keys = reinterpret_cast<ObjString**>(block + capacity);
+	Value* values = reinterpret_cast<Value*>(block + capacity * (1 + sizeof(ObjString*)));
+	memset(control, CONTROL_EMPTY, capacity);
+
+	for (size_t i = 0; i < m_capacity; i++)
+	{
+		if (m_control[i] < 0) continue;
+
+		const size_t slot = findFree(control, capacity, m_keys[i]->hash);
+		control[slot] = m_control[i];
+		keys[slot] = m_keys[i];
+		values[slot] = m_values[i];
+	}
+
+	free(m_control);
+	m_control = control;
+	m_keys = keys;
+	m_values = values;
+	m_capacity = capacity;
+	m_tombstones = 0;
+}
+
+#else
+
 #define TABLE_MAX_LOAD 0.75
 
 
 Table::~Table()
 {
-	FREE_ARRAY(Entry, m_entries, m_capacity);
+	countBytes(m_vm, sizeof(Entry) * m_capacity, 0);
+	free(m_entries);
 }
 
 
@@ -20,6 +298,8 @@ Table::~Table()
 
 static Entry* findEntry(Entry* entries, const size_t capacity, const ObjString* key)
 {
+	// keys are compared by identity, only interned strings can be keys
+	assert(key->interned);
 	uint32_t index = key->hash % capacity;
 	Entry* tombstone = nullptr;
 
@@ -128,19 +408,55 @@ ObjString* Table::findString(const char* chars, size_t length, uint32_t hash) co
 	}
 }
 
-void Table::removeWhite()
+void Table::removeWhite(const VM& vm)
 {
 	for (size_t i = 0; i < m_capacity; i++)
 	{
 		Entry& entry = m_entries[i];
-		if (entry.key != nullptr && !entry.key->obj.isMarked)
+		if (entry.key != nullptr && !isMarked(vm, &entry.key->obj))
 		{
 			del(entry.key);
 		}
 	}
+	compact();
+}
+
+void Table::compact()
+{
+	if (m_capacity == 0) return;
+
+	// m_count includes the tombstones
+	size_t live = 0;
+	for (size_t i = 0; i < m_capacity; i++)
+	{
+		if (m_entries[i].key != nullptr) live++;
+	}
+
+	if (live == 0)
+	{
+		countBytes(m_vm, sizeof(Entry) * m_capacity, 0);
+		free(m_entries);
+		m_entries = nullptr;
+		m_capacity = 0;
+		m_count = 0;
+		return;
+	}
+
+	// the smallest table that has the keys at most half of the maximum load
+	size_t capacity = 8;
+	while (static_cast<size_t>(capacity * TABLE_MAX_LOAD) / 2 < live) capacity *= 2;
+
+	if (capacity <= m_capacity / 4)
+	{
+		adjustCapacity(capacity);
+	}
+	else if (m_count - live > m_capacity / 4)
+	{
+		adjustCapacity(m_capacity);
+	}
 }
 
-void Table::mark()
+void Table::mark(VM& vm)
 {
 	// go through the whole table, because entries aren't contiguous
 	for (size_t i = 0; i < m_capacity; i++)
@@ -148,8 +464,8 @@ void Table::mark()
 		Entry* entry = &m_entries[i];
 		if (entry->key == nullptr) continue;
 
-		markObject((Obj*)entry->key);
-		markValue(entry->value);
+		markObject(vm, (Obj*)entry->key);
+		markValue(vm, entry->value);
 	}
 }
 
@@ -157,7 +473,9 @@ void Table::mark()
 void Table::adjustCapacity(size_t capacity)
 {
 	// allocate new entry array
-	Entry* entries = ALLOCATE(Entry, capacity);
+	Entry* entries = static_cast<Entry*>(malloc(sizeof(Entry) * capacity));
+	if (entries == nullptr) exit(1);
+	countBytes(m_vm, sizeof(Entry) * m_capacity, sizeof(Entry) * capacity);
 
 	// initialize values
 	for (size_t i = 0; i < capacity; i++)
@@ -180,8 +498,9 @@ void Table::adjustCapacity(size_t capacity)
 
 	}
 
-	FREE_ARRAY(Entry, m_entries, m_capacity);
+	free(m_entries);
 	m_entries = entries;
 	m_capacity = capacity;
 }
 
+#endif
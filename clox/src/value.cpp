@@ -8,6 +8,12 @@
 
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+	// numbers compare as doubles so that NaN != NaN, strings by their characters, everything else is identical iff the bits are
+	if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+	if (a == b) return true;
+	return IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b));
+#else
 	if (a.type != b.type) return false;
 	switch (a.type)
 	{
@@ -15,13 +21,20 @@ bool valuesEqual(Value a, Value b)
 	case VAL_BOOL:		return a.as.boolean == b.as.boolean;
 	case VAL_NIL:		return true;
 	case VAL_NUMBER:	return a.as.number == b.as.number;
-	case VAL_OBJ:		return AS_OBJ(a) == AS_OBJ(b);
+	case VAL_OBJ:		return AS_OBJ(a) == AS_OBJ(b) || (IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b)));
 	default: return false;// unreachable
 	}
+#endif
 }
 
 void printValue(const Value& value)
 {
+#ifdef NAN_BOXING
+	if (IS_BOOL(value)) printf(AS_BOOL(value) ? "true" : "false");
+	else if (IS_NIL(value)) printf("nil");
+	else if (IS_NUMBER(value)) printf("%g", AS_NUMBER(value));
+	else if (IS_OBJ(value)) printObject(value);
+#else
 	switch (value.type)
 	{
 	case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
@@ -30,6 +43,6 @@ void printValue(const Value& value)
 	case VAL_OBJ: printObject(value); break;
 	default: return; // unreachable
 	}
+#endif
 	
-}
-
+}
\ No newline at end of file
@@ -1,7 +1,8 @@
 ﻿#include "vm.h"
 
 #include <cstdarg>
-//#include <cstring> // book says I need this, but I don't
+#include <cstdlib>
+#include <cstring>
 
 #include <ctime>
 
@@ -10,21 +11,19 @@
 #include "object.h"
 #include "util.h"
 
-VM vm;
-
-static Value clockNative(int, Value*)
+static Value clockNative(VM&, int, Value*)
 {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void resetStack()
+static void resetStack(VM& vm)
 {
-	vm.stackTop = &vm.stack[0];
+	vm.stackTop = vm.stack;
 	vm.frameCount = 0;
 	vm.openUpvalues = nullptr;
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM& vm, const char* format, ...) {
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
@@ -36,7 +35,7 @@ static void runtimeError(const char* format, ...) {
 		CallFrame* frame = &vm.frames[i];
 		ObjFunction* function = frame->closure->function;
 		size_t instruction = frame->ip - &function->chunk.code[0] - 1;
-		fprintf(stderr, "[line %d] in ", static_cast<int>(function->chunk.lines[instruction]));
+		fprintf(stderr, "[line %d] in ", static_cast<int>(function->chunk.getLine(instruction)));
 		if (function->name == nullptr)
 		{
 			fprintf(stderr, "script\n");
@@ -47,54 +46,121 @@ static void runtimeError(const char* format, ...) {
 		}
 	}
 
-	resetStack();
+	resetStack(vm);
 
 }
 
-static void defineNative(const char* name, NativeFn function)
+size_t globalSlot(VM& vm, ObjString* name)
 {
-	push(OBJ_VAL(copyString(name, (int)strlen(name))));
-	push(OBJ_VAL(newNative(function)));
-	vm.globals.set(AS_STRING(vm.stack[0]), vm.stack[1]);
-	pop();
-	pop();
+	Value slot;
+	if (vm.globals.get(name, &slot)) return static_cast<size_t>(AS_NUMBER(slot));
+
+	const size_t index = vm.globalValues.size();
+	vm.globalValues.write(UNDEFINED_VAL);
+	vm.globalNames.write(name);
+	vm.globals.set(name, NUMBER_VAL(static_cast<double>(index)));
+	return index;
 }
 
-void initVM()
+static void defineNative(VM& vm, const char* name, NativeFn function)
 {
-	resetStack();
+	push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+	push(vm, OBJ_VAL(newNative(vm, function)));
+	vm.globalValues[globalSlot(vm, AS_STRING(vm.stack[0]))] = vm.stack[1];
+	pop(vm);
+	pop(vm);
+}
+
+void initVM(VM& vm)
+{
+	vm.stack = static_cast<Value*>(malloc(sizeof(Value) * STACK_INITIAL));
+	vm.frames = static_cast<CallFrame*>(malloc(sizeof(CallFrame) * FRAMES_INITIAL));
+	if (vm.stack == nullptr || vm.frames == nullptr) exit(1);
+	vm.stackEnd = vm.stack + STACK_INITIAL;
+	vm.frameCapacity = FRAMES_INITIAL;
+	vm.maxFrames = FRAMES_DEFAULT_MAX;
+	resetStack(vm);
+	vm.parser = nullptr;
 	vm.objects = nullptr;
+	vm.oldObjects = nullptr;
+	for (PoolSlot*& freeList : vm.pool.freeLists) freeList = nullptr;
+	vm.pool.pageTop = nullptr;
+	vm.pool.pageEnd = nullptr;
+	vm.pool.pages = nullptr;
 	vm.bytesAllocated = 0;
 	vm.nextGC = 1024 * 1024;
+	vm.nextMinorGC = 0;
+	vm.nextGCStep = 0;
+
+	vm.gcPhase = GC_IDLE;
+	vm.markValue = true;
+	vm.sweepObjects = nullptr;
+	vm.sweepOldObjects = nullptr;
+	vm.gcPauseBudget = 1000;
+
+	vm.gcStats = false;
+	for (size_t& pauses : vm.gcPauses) pauses = 0;
+	vm.gcMaxPause = 0;
+	vm.gcTotalPause = 0;
+
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.rememberedSet = nullptr;
 
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
 	vm.grayStack = nullptr;
 
-	defineNative("clock", clockNative);
+	vm.traceExecution = false;
+	vm.opStats = false;
+	vm.opPairs = nullptr;
+	vm.opTriples = nullptr;
+	vm.previousOps[0] = -1;
+	vm.previousOps[1] = -1;
+	vm.printCode = false;
+
+	defineNative(vm, "clock", clockNative);
 }
 
-void freeVM()
+void freeVM(VM& vm)
 {
-	freeObjects();
+	freeObjects(vm);
+	free(vm.frames);
+	free(vm.stack);
+	free(vm.opPairs);
+	free(vm.opTriples);
 }
 
-static Value peek(int distance) {
+static Value peek(VM& vm, int distance) {
 	return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int argCount)
+// the caller picks its frame up again after the call, so nothing points into the old array
+NOINLINE static void growFrames(VM& vm)
+{
+	vm.frameCapacity = GROW_CAPACITY(vm.frameCapacity);
+	if (vm.frameCapacity > vm.maxFrames) vm.frameCapacity = vm.maxFrames;
+	vm.frames = static_cast<CallFrame*>(realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity));
+	if (vm.frames == nullptr) exit(1);
+}
+
+static bool call(VM& vm, ObjClosure* closure, int argCount)
 {
 	if (argCount != closure->function->arity)
 	{
-		runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+		runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
 		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX)
+	// the capacity never exceeds maxFrames, so only a full array needs the overflow check
+	if (vm.frameCount == vm.frameCapacity)
 	{
-		runtimeError("Stack overflow.");
-		return false;
+		if (vm.frameCount == vm.maxFrames)
+		{
+			runtimeError(vm, "Stack overflow.");
+			return false;
+		}
+		growFrames(vm);
 	}
 
 	CallFrame* frame = &vm.frames[vm.frameCount++];
@@ -104,7 +170,7 @@ static bool call(ObjClosure* closure, int argCount)
 	return true;
 }
 
-static bool callValue(Value callee, int argCount)
+static bool callValue(VM& vm, Value callee, int argCount)
 {
 	if (IS_OBJ(callee))
 	{
@@ -113,28 +179,28 @@ static bool callValue(Value callee, int argCount)
 		case OBJ_CLASS:
 		{
 			ObjClass* klass = AS_CLASS(callee);
-			vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+			vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 			return true;
 		}
 		case OBJ_CLOSURE:
-			return call(AS_CLOSURE(callee), argCount);
+			return call(vm, AS_CLOSURE(callee), argCount);
 		case OBJ_NATIVE:
 		{
 			NativeFn native = AS_NATIVE(callee);
-			Value result = native(argCount, vm.stackTop - argCount);
+			Value result = native(vm, argCount, vm.stackTop - argCount);
 			vm.stackTop -= argCount + 1;
-			push(result);
+			push(vm, result);
 			return true;
 		}
 		default:
 			break; // non-callable object
 		}
 	}
-	runtimeError("can only call functions and classes.");
+	runtimeError(vm, "can only call functions and classes.");
 	return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local)
+static ObjUpvalue* captureUpvalue(VM& vm, Value* local)
 {
 	ObjUpvalue* prevUpvalue = nullptr;
 	ObjUpvalue* upvalue = vm.openUpvalues;
@@ -149,7 +215,8 @@ static ObjUpvalue* captureUpvalue(Value* local)
 		return upvalue;
 	}
 
-	ObjUpvalue* createdUpvalue = newUpvalue(local);
+	ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
+	createdUpvalue->next = upvalue;
 
 	if (prevUpvalue == nullptr)
 	{
@@ -163,320 +230,821 @@ static ObjUpvalue* captureUpvalue(Value* local)
 	return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last)
+static void closeUpvalues(VM& vm, Value* last)
 {
 	while (vm.openUpvalues != nullptr && vm.openUpvalues->location >= last)
 	{
 		ObjUpvalue* upvalue = vm.openUpvalues;
 		upvalue->closed = *upvalue->location;
+		writeBarrier(vm, reinterpret_cast<Obj*>(upvalue), upvalue->closed);
 		upvalue->location = &upvalue->closed;
 		vm.openUpvalues = upvalue->next;
 	}
 }
 
+static void addCacheEntry(VM& vm, ObjFunction* function, PropertyCache& cache, ObjShape* shape, ObjShape* newShape, int slot)
+{
+	if (cache.count == PROPERTY_CACHE_SIZE) return; // megamorphic
+	for (int i = 0; i < cache.count; i++)
+	{
+		if (cache.entries[i].shape == shape) return;
+	}
+
+	cache.entries[cache.count++] = { shape, newShape, slot };
+	writeBarrier(vm, reinterpret_cast<Obj*>(function), OBJ_VAL(shape));
+	if (newShape != nullptr) writeBarrier(vm, reinterpret_cast<Obj*>(function), OBJ_VAL(newShape));
+}
+
 static bool isFalsey(Value value) {
-	return IS_NIL(value) || IS_BOOL(value) && !value.as.boolean;
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static void concatenate(VM& vm)
+{
+	const Value b = peek(vm, 0);
+	const Value a = peek(vm, 1);
+
+	// long results become ropes, so building a string piece by piece doesn't copy it over and over
+	Value result;
+	const size_t length = stringLength(a) + stringLength(b);
+	if (length >= ROPE_MIN_LENGTH || !IS_STRING(a) || !IS_STRING(b))
+	{
+		result = OBJ_VAL(newRope(vm, a, b));
+	}
+	else
+	{
+		// not interned, most results are only printed or concatenated further
+		ObjString* string = newString(vm, length);
+		memcpy(string->chars, AS_CSTRING(a), AS_STRING(a)->length);
+		memcpy(string->chars + AS_STRING(a)->length, AS_CSTRING(b), AS_STRING(b)->length);
+		result = OBJ_VAL(string);
+	}
+
+	pop(vm);
+	pop(vm);
+	push(vm, result);
+}
+
+// valuesEqual compares the characters of strings, so ropes about to be compared are flattened in place
+static void flattenOperands(VM& vm)
+{
+	for (int distance = 0; distance < 2; distance++)
+	{
+		if (!IS_ROPE(peek(vm, distance))) continue;
+		ObjString* flat = flattenRope(vm, AS_ROPE(peek(vm, distance)));
+		vm.stackTop[-1 - distance] = OBJ_VAL(flat);
+	}
+}
+
+static void traceInstruction(VM& vm, const CallFrame* frame)
+{
+	printf("          ");
+	grey();
+	for (Value* slot = &vm.stack[0]; slot < vm.stackTop; slot++)
+	{
+		if (slot == frame->slots) white();
+		printf("[ ");
+		if (isString(*slot)) { printf("\""); }
+		printValue(*slot);
+		if (isString(*slot)) { printf("\""); }
+		printf(" ]");
+	}
+	printf("\n");
+
+	frame->closure->function->chunk.disassembleInstruction(vm, static_cast<int>(frame->ip - &frame->closure->function->chunk.code[0]));
+}
+
+// counts the sequences of opcodes as they run, this is what superinstructions get picked by
+static void countInstruction(VM& vm, const uint8_t op)
+{
+	if (vm.opPairs == nullptr)
+	{
+		vm.opPairs = static_cast<size_t*>(calloc(OP_COUNT * OP_COUNT, sizeof(size_t)));
+		vm.opTriples = static_cast<size_t*>(calloc(OP_COUNT * OP_COUNT * OP_COUNT, sizeof(size_t)));
+		if (vm.opPairs == nullptr || vm.opTriples == nullptr) exit(1);
+	}
+
+	const int first = vm.previousOps[0];
+	const int second = vm.previousOps[1];
+	if (second != -1) vm.opPairs[second * OP_COUNT + op]++;
+	if (first != -1) vm.opTriples[(first * OP_COUNT + second) * OP_COUNT + op]++;
+
+	vm.previousOps[0] = second;
+	vm.previousOps[1] = op;
+}
+
+struct OpCount
+{
+	size_t index;
+	size_t count;
+};
+
+static int compareOpCounts(const void* a, const void* b)
+{
+	const size_t countA = static_cast<const OpCount*>(a)->count;
+	const size_t countB = static_cast<const OpCount*>(b)->count;
+	return countA < countB ? 1 : countA > countB ? -1 : 0;
 }
 
-static void concatenate()
+static void printTopSequences(const char* title, const size_t* counts, const size_t size, const int length)
 {
-	ObjString* b = AS_STRING(peek(0));
-	ObjString* a = AS_STRING(peek(1));
-
-	size_t length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
-
-	ObjString* result = takeString(chars, length);
-	pop();
-	pop();
-	push(OBJ_VAL(result));
+	OpCount* sorted = static_cast<OpCount*>(malloc(size * sizeof(OpCount)));
+	if (sorted == nullptr) exit(1);
+
+	size_t total = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		sorted[i] = OpCount{ i, counts[i] };
+		total += counts[i];
+	}
+	qsort(sorted, size, sizeof(OpCount), compareOpCounts);
+
+	printf("%s (%zu total)\n", title, total);
+	for (size_t i = 0; i < 20 && i < size && sorted[i].count > 0; i++)
+	{
+		printf("  %5.2f%% %12zu ", 100.0 * static_cast<double>(sorted[i].count) / static_cast<double>(total), sorted[i].count);
+		size_t index = sorted[i].index;
+		const char* names[3];
+		for (int j = length - 1; j >= 0; j--)
+		{
+			names[j] = OpNames[index % OP_COUNT];
+			index /= OP_COUNT;
+		}
+		for (int j = 0; j < length; j++) printf(" %s", names[j]);
+		printf("\n");
+	}
+
+	free(sorted);
 }
 
-[[maybe_unused]] static InterpretResult run()
+void printOpStats(const VM& vm)
+{
+	if (vm.opPairs == nullptr) return;
+	printTopSequences("opcode pairs", vm.opPairs, OP_COUNT * OP_COUNT, 2);
+	printTopSequences("opcode triples", vm.opTriples, OP_COUNT * OP_COUNT * OP_COUNT, 3);
+}
+
+#if defined(COMPUTED_GOTO) && defined(__GNUC__) && !defined(__clang__)
+// gcc merges the identical dispatch jumps at the end of the handlers back into one, which undoes the point of them
+#pragma GCC push_options
+#pragma GCC optimize("-fno-crossjumping")
+#endif
+
+// run() is instantiated once with and once without instrumentation (tracing or opcode counting),
+// so the plain loop carries no checks for either
+template <bool Instrumented>
+static InterpretResult run(VM& vm)
 {
 	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	// set when an instruction was rewritten, so it isn't traced and counted a second time when it runs again
+	[[maybe_unused]] bool rewritten = false;
 
+#define TRACE_INSTRUCTION() \
+	do { \
+		if constexpr (Instrumented) \
+		{ \
+			if (rewritten) \
+			{ \
+				rewritten = false; \
+			} \
+			else \
+			{ \
+				if (vm.traceExecution) traceInstruction(vm, frame); \
+				if (vm.opStats) countInstruction(vm, *frame->ip); \
+			} \
+		} \
+	} while (false)
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() (frame->closure->function->chunk.constants[READ_BYTE()])
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_PROPERTY_CACHE() (frame->closure->function->chunk.propertyCaches[READ_SHORT()])
 #define BINARY_OP(valueType, op) \
 	do { \
-		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-			runtimeError("Operands must be numbers."); \
+		const Value b = vm.stackTop[-1]; \
+		const Value a = vm.stackTop[-2]; \
+		if (!ARE_NUMBERS(a, b)) { \
+			runtimeError(vm, "Operands must be numbers."); \
 			return INTERPRET_RUNTIME_ERROR;\
 		} \
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		push (valueType(a op b)); \
+		vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+		vm.stackTop--; \
 	} while  (false)
+// rewrites the current instruction, which hasn't read any operands yet, and runs it again in its new form
+// a plain block rather than do-while, DISPATCH() is a continue without computed gotos
+#define REWRITE_INSTRUCTION(op) \
+	{ \
+		frame->ip[-1] = op; \
+		frame->ip--; \
+		if constexpr (Instrumented) rewritten = true; \
+		DISPATCH(); \
+	}
+// jumpIf is written in terms of the popped numbers a and b
+#define COMPARE_JUMP(jumpIf) \
+	do { \
+		const uint16_t offset = READ_SHORT(); \
+		if (!ARE_NUMBERS(peek(vm, 0), peek(vm, 1))) { \
+			runtimeError(vm, "Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR;\
+		} \
+		const double b = AS_NUMBER(pop(vm)); \
+		const double a = AS_NUMBER(pop(vm)); \
+		if (jumpIf) frame->ip += offset; \
+	} while (false)
 
-	for (;;)
-	{
-#ifdef DEBUG_TRACE_EXECUTION
+#ifdef COMPUTED_GOTO
+	// every handler jumps straight to the next one, so each opcode gets its own indirect branch
+	// this table has to be kept in the same order as the Op enum in chunk.h
+	static void* dispatchTable[] = {
+		&&TARGET_OP_CONSTANT,
+		&&TARGET_OP_NIL,
+		&&TARGET_OP_TRUE,
+		&&TARGET_OP_FALSE,
+		&&TARGET_OP_POP,
+		&&TARGET_OP_GET_LOCAL,
+		&&TARGET_OP_SET_LOCAL,
+		&&TARGET_OP_GET_GLOBAL,
+		&&TARGET_OP_DEFINE_GLOBAL,
+		&&TARGET_OP_SET_GLOBAL,
+		&&TARGET_OP_GET_UPVALUE,
+		&&TARGET_OP_SET_UPVALUE,
+		&&TARGET_OP_GET_PROPERTY,
+		&&TARGET_OP_SET_PROPERTY,
+		&&TARGET_OP_EQUAL,
+		&&TARGET_OP_GREATER,
+		&&TARGET_OP_LESS,
+		&&TARGET_OP_ADD,
+		&&TARGET_OP_SUBTRACT,
+		&&TARGET_OP_MULTIPLY,
+		&&TARGET_OP_DIVIDE,
+		&&TARGET_OP_NOT,
+		&&TARGET_OP_NEGATE,
+		&&TARGET_OP_PRINT,
+		&&TARGET_OP_JUMP,
+		&&TARGET_OP_JUMP_IF_FALSE,
+		&&TARGET_OP_LOOP,
+		&&TARGET_OP_CALL,
+		&&TARGET_OP_CLOSURE,
+		&&TARGET_OP_CLOSE_UPVALUE,
+		&&TARGET_OP_RETURN,
+		&&TARGET_OP_CLASS,
+		&&TARGET_OP_NOT_EQUAL,
+		&&TARGET_OP_GREATER_EQUAL,
+		&&TARGET_OP_LESS_EQUAL,
+		&&TARGET_OP_POP_JUMP_IF_FALSE,
+		&&TARGET_OP_ADD_CONSTANT,
+		&&TARGET_OP_SUBTRACT_CONSTANT,
+		&&TARGET_OP_LESS_CONSTANT,
+		&&TARGET_OP_SET_LOCAL_POP,
+		&&TARGET_OP_SET_GLOBAL_POP,
+		&&TARGET_OP_JUMP_UNLESS_EQUAL,
+		&&TARGET_OP_JUMP_UNLESS_NOT_EQUAL,
+		&&TARGET_OP_JUMP_UNLESS_GREATER,
+		&&TARGET_OP_JUMP_UNLESS_LESS,
+		&&TARGET_OP_JUMP_UNLESS_GREATER_EQUAL,
+		&&TARGET_OP_JUMP_UNLESS_LESS_EQUAL,
+		&&TARGET_OP_JUMP_UNLESS_LESS_CONSTANT,
+		&&TARGET_OP_ADD_NUM,
+		&&TARGET_OP_EQUAL_NUM,
+		&&TARGET_OP_NOT_EQUAL_NUM,
+		&&TARGET_OP_GET_PROPERTY_MONO,
+		&&TARGET_OP_TAIL_CALL,
+	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT, "dispatchTable is out of sync with Op");
 
-		printf("          ");
-		grey();
-		for (Value* slot = &vm.stack[0]; slot < vm.stackTop; slot++)
-		{
-			if (slot == frame->slots) white();
-			printf("[ ");
-			if (slot->type == VAL_OBJ && IS_STRING(*slot)) { printf("\""); }
-			printValue(*slot);
-			if (slot->type == VAL_OBJ && IS_STRING(*slot)) { printf("\""); }
-			printf(" ]");
-		}
-		printf("\n");
-
-		frame->closure->function->chunk.disassembleInstruction(static_cast<int>(frame->ip - &frame->closure->function->chunk.code[0]));
+#define TARGET(op) case op: TARGET_##op
+#define DISPATCH() do { TRACE_INSTRUCTION(); goto *dispatchTable[READ_BYTE()]; } while (false)
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
 #endif
 
-		switch (Op instruction = static_cast<Op>(READ_BYTE()))
+	for (;;)
+	{
+		TRACE_INSTRUCTION();
+
+		switch (static_cast<Op>(READ_BYTE()))
 		{
-		case OP_CONSTANT:
+		TARGET(OP_CONSTANT):
 		{
 			const Value constant = READ_CONSTANT();
-			push(constant);
-			break;
+			push(vm, constant);
+			DISPATCH();
 		}
-		case OP_NIL: push(NIL_VAL); break;
-		case OP_TRUE: push(BOOL_VAL(true)); break;
-		case OP_FALSE: push(BOOL_VAL(false)); break;
-		case OP_POP: pop(); break;
-		case OP_GET_LOCAL:
+		TARGET(OP_NIL): push(vm, NIL_VAL); DISPATCH();
+		TARGET(OP_TRUE): push(vm, BOOL_VAL(true)); DISPATCH();
+		TARGET(OP_FALSE): push(vm, BOOL_VAL(false)); DISPATCH();
+		TARGET(OP_POP): pop(vm); DISPATCH();
+		TARGET(OP_GET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]);
-			break;
+			push(vm, frame->slots[slot]);
+			DISPATCH();
 		}
-		case OP_SET_LOCAL:
+		TARGET(OP_SET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(0);
-			break;
+			frame->slots[slot] = peek(vm, 0);
+			DISPATCH();
 		}
-		case OP_GET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			Value value;
-			if (!vm.globals.get(name, &value))
+		TARGET(OP_GET_GLOBAL): {
+			const uint16_t slot = READ_SHORT();
+			const Value value = vm.globalValues[slot];
+			if (IS_UNDEFINED(value))
 			{
-				runtimeError("Undefined variable '%s'.", name->chars);
+				runtimeError(vm, "Undefined variable '%s'.", vm.globalNames[slot]->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(value);
-			break;
+			push(vm, value);
+			DISPATCH();
 		}
-		case OP_DEFINE_GLOBAL: {
-			ObjString* name = READ_STRING();
-			vm.globals.set(name, peek(0));
-			pop();
-			break;
+		TARGET(OP_DEFINE_GLOBAL): {
+			const uint16_t slot = READ_SHORT();
+			vm.globalValues[slot] = pop(vm);
+			DISPATCH();
 		}
-		case OP_SET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			if (vm.globals.set(name, peek(0)))
+		TARGET(OP_SET_GLOBAL): {
+			const uint16_t slot = READ_SHORT();
+			Value& value = vm.globalValues[slot];
+			if (IS_UNDEFINED(value))
 			{
-				vm.globals.del(name);
-				runtimeError("Undefined variable '%s'.", name->chars);
+				runtimeError(vm, "Undefined variable '%s'.", vm.globalNames[slot]->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			value = peek(vm, 0);
+			DISPATCH();
 		}
-		case OP_GET_UPVALUE:
+		TARGET(OP_GET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
-			break;
+			push(vm, *frame->closure->upvalues[slot]->location);
+			DISPATCH();
 		}
-		case OP_SET_UPVALUE:
+		TARGET(OP_SET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
-			break;
+			ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+			*upvalue->location = peek(vm, 0);
+			writeBarrier(vm, reinterpret_cast<Obj*>(upvalue), peek(vm, 0));
+			DISPATCH();
 		}
-		case OP_GET_PROPERTY:
+		TARGET(OP_GET_PROPERTY):
 		{
-			if (!IS_INSTANCE(peek(0)))
+			if (!IS_INSTANCE(peek(vm, 0)))
 			{
-				runtimeError("Only instances have properties.");
+				runtimeError(vm, "Only instances have properties.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			ObjInstance* instance = AS_INSTANCE(peek(0));
+			ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
 			ObjString* name = READ_STRING();
+			PropertyCache& cache = READ_PROPERTY_CACHE();
 
-			Value value;
-			if (instance->fields.get(name, &value)) {
-				pop(); // instance
-				push(value);
-				break;
+			for (int i = 0; i < cache.count; i++)
+			{
+				if (cache.entries[i].shape == instance->shape)
+				{
+					// a monomorphic hit quickens the instruction
+					if (cache.count == 1) frame->ip[-4] = OP_GET_PROPERTY_MONO;
+					vm.stackTop[-1] = instance->fields[cache.entries[i].slot];
+					DISPATCH();
+				}
 			}
 
-			runtimeError("Undefined property '%s'.", name->chars);
-			return INTERPRET_RUNTIME_ERROR;
+			const int slot = findField(instance->shape, name);
+			if (slot == -1)
+			{
+				runtimeError(vm, "Undefined property '%s'.", name->chars);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			addCacheEntry(vm, frame->closure->function, cache, instance->shape, nullptr, slot);
+			vm.stackTop[-1] = instance->fields[slot];
+			DISPATCH();
 		}
-		case OP_SET_PROPERTY:
+		TARGET(OP_SET_PROPERTY):
 		{
-			if (!IS_INSTANCE(peek(1)))
+			if (!IS_INSTANCE(peek(vm, 1)))
 			{
-				runtimeError("Only instances have fields.");
+				runtimeError(vm, "Only instances have fields.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			ObjInstance* instance = AS_INSTANCE(peek(1));
+			ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
 			ObjString* name = READ_STRING();
-			Value value = pop();
-			instance->fields.set(name, value);
-			pop(); // instance
-			push(value);
-			break;
+			PropertyCache& cache = READ_PROPERTY_CACHE();
+
+			bool hit = false;
+			for (int i = 0; i < cache.count; i++)
+			{
+				const PropertyCacheEntry& entry = cache.entries[i];
+				if (entry.shape != instance->shape) continue;
+
+				// a cached transition only applies if the new field still fits
+				if (entry.newShape != nullptr && entry.slot >= instance->fieldCapacity) break;
+
+				instance->fields[entry.slot] = peek(vm, 0);
+				writeBarrier(vm, reinterpret_cast<Obj*>(instance), peek(vm, 0));
+				if (entry.newShape != nullptr)
+				{
+					instance->shape = entry.newShape;
+					writeBarrier(vm, reinterpret_cast<Obj*>(instance), OBJ_VAL(entry.newShape));
+					updateInlineFieldCount(instance->klass, entry.newShape);
+				}
+				hit = true;
+				break;
+			}
+
+			if (!hit)
+			{
+				ObjShape* shape = instance->shape;
+				setField(vm, instance, name, peek(vm, 0)); // keep both on the stack, adding a field can allocate
+				if (instance->shape == shape)
+				{
+					addCacheEntry(vm, frame->closure->function, cache, shape, nullptr, findField(shape, name));
+				}
+				else
+				{
+					addCacheEntry(vm, frame->closure->function, cache, shape, instance->shape, shape->fieldCount);
+				}
+			}
+
+			Value value = pop(vm);
+			vm.stackTop[-1] = value; // replace the instance
+			DISPATCH();
 		}
-		case OP_EQUAL:
-			Value r = pop();
-			Value l = pop();
-			push(BOOL_VAL(valuesEqual(l, r)));
-			break;
-		case OP_GREATER:	BINARY_OP(BOOL_VAL, > ); break;
-		case OP_LESS:		BINARY_OP(BOOL_VAL, < ); break;
+		TARGET(OP_EQUAL):
+		{
+			if (ARE_NUMBERS(peek(vm, 0), peek(vm, 1))) REWRITE_INSTRUCTION(OP_EQUAL_NUM);
+			flattenOperands(vm);
+			Value r = pop(vm);
+			Value l = pop(vm);
+			push(vm, BOOL_VAL(valuesEqual(l, r)));
+			DISPATCH();
+		}
+		TARGET(OP_GREATER):	BINARY_OP(BOOL_VAL, > ); DISPATCH();
+		TARGET(OP_LESS):	BINARY_OP(BOOL_VAL, < ); DISPATCH();
+		TARGET(OP_NOT_EQUAL):
+		{
+			if (ARE_NUMBERS(peek(vm, 0), peek(vm, 1))) REWRITE_INSTRUCTION(OP_NOT_EQUAL_NUM);
+			flattenOperands(vm);
+			Value r = pop(vm);
+			Value l = pop(vm);
+			push(vm, BOOL_VAL(!valuesEqual(l, r)));
+			DISPATCH();
+		}
+		// negated rather than >= and <= so that nan gives the same answer as the OP_NOT sequences these replace
+		TARGET(OP_GREATER_EQUAL):
+			BINARY_OP(BOOL_VAL, < );
+			vm.stackTop[-1] = BOOL_VAL(!AS_BOOL(vm.stackTop[-1]));
+			DISPATCH();
+		TARGET(OP_LESS_EQUAL):
+			BINARY_OP(BOOL_VAL, > );
+			vm.stackTop[-1] = BOOL_VAL(!AS_BOOL(vm.stackTop[-1]));
+			DISPATCH();
 
-		case OP_ADD: {
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+		TARGET(OP_ADD): {
+			if (isString(peek(vm, 0)) && isString(peek(vm, 1)))
 			{
-				concatenate();
+				concatenate(vm);
 			}
-			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+			else if (ARE_NUMBERS(peek(vm, 0), peek(vm, 1)))
 			{
-				double b = AS_NUMBER(pop());
-				double a = AS_NUMBER(pop());
-				push(NUMBER_VAL(a + b));
+				REWRITE_INSTRUCTION(OP_ADD_NUM);
 			}
 			else
 			{
-				runtimeError("Operands must be two numbers or two strings.");
+				runtimeError(vm, "Operands must be two numbers or two strings.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			DISPATCH();
 		}
-		case OP_SUBTRACT:	BINARY_OP(NUMBER_VAL, -); break;
-		case OP_MULTIPLY:	BINARY_OP(NUMBER_VAL, *); break;
-		case OP_DIVIDE:		BINARY_OP(NUMBER_VAL, / ); break;
-		case OP_NOT:
-			push(BOOL_VAL(isFalsey(pop())));
-			break;
-		case OP_NEGATE:
-			if (!IS_NUMBER(peek(0))) {
-				runtimeError("Operand must be a number.");
+		TARGET(OP_SUBTRACT):	BINARY_OP(NUMBER_VAL, -); DISPATCH();
+		TARGET(OP_MULTIPLY):	BINARY_OP(NUMBER_VAL, *); DISPATCH();
+		TARGET(OP_DIVIDE):		BINARY_OP(NUMBER_VAL, / ); DISPATCH();
+		TARGET(OP_NOT):
+			push(vm, BOOL_VAL(isFalsey(pop(vm))));
+			DISPATCH();
+		TARGET(OP_NEGATE):
+			if (!IS_NUMBER(peek(vm, 0))) {
+				runtimeError(vm, "Operand must be a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(NUMBER_VAL(-AS_NUMBER(pop())));
-			break;
-		case OP_PRINT:
-			printValue(pop());
+			push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+			DISPATCH();
+		TARGET(OP_PRINT):
+			printValue(pop(vm));
 			printf("\n");
-			break;
-		case OP_JUMP:
+			DISPATCH();
+		TARGET(OP_JUMP):
 		{
 			uint16_t offset = READ_SHORT();
 			frame->ip += offset;
-			break;
+			DISPATCH();
 		}
-		case OP_JUMP_IF_FALSE:
+		TARGET(OP_JUMP_IF_FALSE):
 		{
 			uint16_t offset = READ_SHORT();
-			if (isFalsey(peek(0))) frame->ip += offset;
-			break;
+			if (isFalsey(peek(vm, 0))) frame->ip += offset;
+			DISPATCH();
 		}
-		case OP_LOOP:
+		TARGET(OP_POP_JUMP_IF_FALSE):
+		{
+			uint16_t offset = READ_SHORT();
+			if (isFalsey(pop(vm))) frame->ip += offset;
+			DISPATCH();
+		}
+		TARGET(OP_LOOP):
 		{
 			const uint16_t offset = READ_SHORT();
 			frame->ip -= offset;
-			break;
+			DISPATCH();
 		}
-		case OP_CALL:
+		TARGET(OP_CALL):
 		{
 			int argCount = READ_BYTE();
-			if (!callValue(peek(argCount), argCount))
+			if (!callValue(vm, peek(vm, argCount), argCount))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			DISPATCH();
 		}
-		case OP_CLOSURE:
+		TARGET(OP_CLOSURE):
 		{
 			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure* closure = newClosure(function);
-			push(OBJ_VAL(closure));
+			ObjClosure* closure = newClosure(vm, function);
+			push(vm, OBJ_VAL(closure));
 			for (int i = 0; i < closure->upvalueCount; i++)
 			{
 				uint8_t isLocal = READ_BYTE();
 				uint8_t index = READ_BYTE();
 				if (isLocal)
 				{
-					closure->upvalues[i] = captureUpvalue(frame->slots + index);
+					closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
 				}
 				else
 				{
 					closure->upvalues[i] = frame->closure->upvalues[index];
 				}
+				// capturing can allocate, which may already have promoted the closure
+				writeBarrier(vm, reinterpret_cast<Obj*>(closure), OBJ_VAL(closure->upvalues[i]));
 			}
-			break;
+			DISPATCH();
 		}
-		case OP_CLOSE_UPVALUE:
-			closeUpvalues(vm.stackTop - 1);
-			pop();
-			break;
-		case OP_RETURN:
+		TARGET(OP_CLOSE_UPVALUE):
+			closeUpvalues(vm, vm.stackTop - 1);
+			pop(vm);
+			DISPATCH();
+		TARGET(OP_RETURN):
 		{
-			Value result = pop();
-			closeUpvalues(frame->slots);
+			Value result = pop(vm);
+			closeUpvalues(vm, frame->slots);
 			vm.frameCount--;
 			if (vm.frameCount == 0)
 			{
-				pop();
+				pop(vm);
 				return INTERPRET_OK;
 			}
 
 			vm.stackTop = frame->slots;
-			push(result);
+			push(vm, result);
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			DISPATCH();
+		}
+		TARGET(OP_CLASS):
+			push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+			DISPATCH();
+		// superinstructions, each one does the work of an OP_CONSTANT or OP_POP in the same dispatch
+		TARGET(OP_ADD_CONSTANT):
+		{
+			const Value b = READ_CONSTANT();
+			const Value a = peek(vm, 0);
+			if (IS_NUMBER(a) && IS_NUMBER(b))
+			{
+				vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+			}
+			else if (isString(a) && IS_STRING(b))
+			{
+				push(vm, b);
+				concatenate(vm);
+			}
+			else
+			{
+				runtimeError(vm, "Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			DISPATCH();
+		}
+		TARGET(OP_SUBTRACT_CONSTANT):
+		{
+			const Value b = READ_CONSTANT();
+			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(b))
+			{
+				runtimeError(vm, "Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(vm, 0)) - AS_NUMBER(b));
+			DISPATCH();
+		}
+		TARGET(OP_LESS_CONSTANT):
+		{
+			const Value b = READ_CONSTANT();
+			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(b))
+			{
+				runtimeError(vm, "Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			vm.stackTop[-1] = BOOL_VAL(AS_NUMBER(peek(vm, 0)) < AS_NUMBER(b));
+			DISPATCH();
+		}
+		TARGET(OP_SET_LOCAL_POP):
+		{
+			uint8_t slot = READ_BYTE();
+			frame->slots[slot] = pop(vm);
+			DISPATCH();
+		}
+		TARGET(OP_SET_GLOBAL_POP):
+		{
+			const uint16_t slot = READ_SHORT();
+			Value& value = vm.globalValues[slot];
+			if (IS_UNDEFINED(value))
+			{
+				runtimeError(vm, "Undefined variable '%s'.", vm.globalNames[slot]->chars);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			value = pop(vm);
+			DISPATCH();
+		}
+		TARGET(OP_JUMP_UNLESS_EQUAL):
+		{
+			const uint16_t offset = READ_SHORT();
+			flattenOperands(vm);
+			Value r = pop(vm);
+			Value l = pop(vm);
+			if (!valuesEqual(l, r)) frame->ip += offset;
+			DISPATCH();
+		}
+		TARGET(OP_JUMP_UNLESS_NOT_EQUAL):
+		{
+			const uint16_t offset = READ_SHORT();
+			flattenOperands(vm);
+			Value r = pop(vm);
+			Value l = pop(vm);
+			if (valuesEqual(l, r)) frame->ip += offset;
+			DISPATCH();
+		}
+		TARGET(OP_JUMP_UNLESS_GREATER):			COMPARE_JUMP(!(a > b)); DISPATCH();
+		TARGET(OP_JUMP_UNLESS_LESS):			COMPARE_JUMP(!(a < b)); DISPATCH();
+		// >= and <= are !(a < b) and !(a > b), see OP_GREATER_EQUAL
+		TARGET(OP_JUMP_UNLESS_GREATER_EQUAL):	COMPARE_JUMP(a < b); DISPATCH();
+		TARGET(OP_JUMP_UNLESS_LESS_EQUAL):		COMPARE_JUMP(a > b); DISPATCH();
+		TARGET(OP_JUMP_UNLESS_LESS_CONSTANT):
+		{
+			const Value b = READ_CONSTANT();
+			const uint16_t offset = READ_SHORT();
+			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(b))
+			{
+				runtimeError(vm, "Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (!(AS_NUMBER(pop(vm)) < AS_NUMBER(b))) frame->ip += offset;
+			DISPATCH();
+		}
+		// quickened instructions, a failed guard turns them back into the generic form
+		TARGET(OP_ADD_NUM):
+		{
+			const Value b = vm.stackTop[-1];
+			const Value a = vm.stackTop[-2];
+			if (!ARE_NUMBERS(a, b)) REWRITE_INSTRUCTION(OP_ADD);
+			vm.stackTop[-2] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+			vm.stackTop--;
+			DISPATCH();
+		}
+		TARGET(OP_EQUAL_NUM):
+		{
+			const Value b = vm.stackTop[-1];
+			const Value a = vm.stackTop[-2];
+			if (!ARE_NUMBERS(a, b)) REWRITE_INSTRUCTION(OP_EQUAL);
+			vm.stackTop[-2] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+			vm.stackTop--;
+			DISPATCH();
+		}
+		TARGET(OP_NOT_EQUAL_NUM):
+		{
+			const Value b = vm.stackTop[-1];
+			const Value a = vm.stackTop[-2];
+			if (!ARE_NUMBERS(a, b)) REWRITE_INSTRUCTION(OP_NOT_EQUAL);
+			vm.stackTop[-2] = BOOL_VAL(AS_NUMBER(a) != AS_NUMBER(b));
+			vm.stackTop--;
+			DISPATCH();
+		}
+		TARGET(OP_GET_PROPERTY_MONO):
+		{
+			const PropertyCacheEntry& entry = frame->closure->function->chunk.propertyCaches[frame->ip[1] << 8 | frame->ip[2]].entries[0];
+			const Value receiver = peek(vm, 0);
+			if (!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->shape != entry.shape) REWRITE_INSTRUCTION(OP_GET_PROPERTY);
+			vm.stackTop[-1] = AS_INSTANCE(receiver)->fields[entry.slot];
+			frame->ip += 3;
+			DISPATCH();
+		}
+		TARGET(OP_TAIL_CALL):
+		{
+			int argCount = READ_BYTE();
+			Value callee = peek(vm, argCount);
+			if (!IS_CLOSURE(callee))
+			{
+				// natives and classes don't get a frame anyway, the OP_RETURN after this returns their result
+				if (!callValue(vm, callee, argCount))
+				{
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &vm.frames[vm.frameCount - 1];
+				DISPATCH();
+			}
+
+			ObjClosure* closure = AS_CLOSURE(callee);
+			if (argCount != closure->function->arity)
+			{
+				runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			// the callee and its arguments replace this frame's slots
+			closeUpvalues(vm, frame->slots);
+			memmove(frame->slots, vm.stackTop - argCount - 1, (argCount + 1) * sizeof(Value));
+			vm.stackTop = frame->slots + argCount + 1;
+			frame->closure = closure;
+			frame->ip = &closure->function->chunk.code[0];
+			DISPATCH();
 		}
-		case OP_CLASS:
-			push(OBJ_VAL(newClass(READ_STRING())));
-			break;
 		default:
 			break;
 		}
 	}
+#undef DISPATCH
+#undef TARGET
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef REWRITE_INSTRUCTION
+#undef TRACE_INSTRUCTION
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_PROPERTY_CACHE
 #undef READ_SHORT
 #undef READ_BYTE
 }
 
-InterpretResult interpret(const std::string& source)
+#if defined(COMPUTED_GOTO) && defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+InterpretResult interpret(VM& vm, const std::string& source)
 {
-	ObjFunction* function = compile(source);
+	ObjFunction* function = compile(vm, source);
 	if (function == nullptr) return INTERPRET_COMPILE_ERROR;
 
-	push(OBJ_VAL(function));
-	ObjClosure* closure = newClosure(function);
-	pop();
-	push(OBJ_VAL(closure));
-	call(closure, 0);
+	push(vm, OBJ_VAL(function));
+	ObjClosure* closure = newClosure(vm, function);
+	pop(vm);
+	push(vm, OBJ_VAL(closure));
+	call(vm, closure, 0);
 
-	return run();
+	return vm.traceExecution || vm.opStats ? run<true>(vm) : run<false>(vm);
+}
+
+// moves the value stack to a bigger allocation and fixes up everything that points into it
+// not reallocate(), a collection here would miss the value that's about to be pushed
+NOINLINE static void growStack(VM& vm)
+{
+	Value* oldStack = vm.stack;
+	const size_t capacity = static_cast<size_t>(vm.stackEnd - vm.stack);
+	const size_t newCapacity = GROW_CAPACITY(capacity);
+
+	// copy instead of realloc so the old pointers stay valid until everything is rebased
+	vm.stack = static_cast<Value*>(malloc(sizeof(Value) * newCapacity));
+	if (vm.stack == nullptr) exit(1);
+	memcpy(vm.stack, oldStack, sizeof(Value) * capacity);
+
+	vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+	vm.stackEnd = vm.stack + newCapacity;
+	for (size_t i = 0; i < vm.frameCount; i++)
+	{
+		vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+	}
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != nullptr; upvalue = upvalue->next)
+	{
+		upvalue->location = vm.stack + (upvalue->location - oldStack);
+	}
+	free(oldStack);
 }
 
-void push(Value value)
+void push(VM& vm, Value value)
 {
+	if (vm.stackTop == vm.stackEnd) [[unlikely]] growStack(vm);
 	*vm.stackTop = value; // nts: move?
 	vm.stackTop++;
 }
 
-Value pop()
+Value pop(VM& vm)
 {
 	vm.stackTop--;
 	return *vm.stackTop;